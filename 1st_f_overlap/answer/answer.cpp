@@ -1,14 +1,23 @@
+#include <algorithm>
+#include <condition_variable>
 #include <cstdint>
+#include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <fcntl.h>
 #include <filesystem>
 #include <fstream>
+#include <immintrin.h>
+#include <iomanip>
 #include <iostream>
 #include <mpi.h>
+#include <mutex>
 #include <openssl/evp.h>
 #include <openssl/sha.h>
 #include <sys/mman.h>
+#include <thread>
 #include <unistd.h>
+#include <vector>
 
 #define DIGEST_NAME "SHA512"
 
@@ -23,6 +32,465 @@ int get_num_block(int rank, int nprocs, int num_block_total)
     return num_block_total / nprocs + ((rank < num_block_total % nprocs) ? 1 : 0);
 }
 
+// SHA-512 on raw states, for hashing block bodies in SIMD lanes: the chain
+// only enters after the 1 MiB body of a block, which is a whole number of
+// 128-byte SHA-512 blocks, so the state after the body (its midstate) does not
+// depend on the previous digest; one more compression over {previous digest,
+// padding, length} finishes the block
+constexpr size_t SHA_BLOCK = 128;
+
+constexpr uint64_t SHA512_IV[8] = {
+    0x6a09e667f3bcc908ull, 0xbb67ae8584caa73bull, 0x3c6ef372fe94f82bull, 0xa54ff53a5f1d36f1ull,
+    0x510e527fade682d1ull, 0x9b05688c2b3e6c1full, 0x1f83d9abfb41bd6bull, 0x5be0cd19137e2179ull,
+};
+
+constexpr uint64_t K512[80] = {
+    0x428a2f98d728ae22ull, 0x7137449123ef65cdull, 0xb5c0fbcfec4d3b2full, 0xe9b5dba58189dbbcull,
+    0x3956c25bf348b538ull, 0x59f111f1b605d019ull, 0x923f82a4af194f9bull, 0xab1c5ed5da6d8118ull,
+    0xd807aa98a3030242ull, 0x12835b0145706fbeull, 0x243185be4ee4b28cull, 0x550c7dc3d5ffb4e2ull,
+    0x72be5d74f27b896full, 0x80deb1fe3b1696b1ull, 0x9bdc06a725c71235ull, 0xc19bf174cf692694ull,
+    0xe49b69c19ef14ad2ull, 0xefbe4786384f25e3ull, 0x0fc19dc68b8cd5b5ull, 0x240ca1cc77ac9c65ull,
+    0x2de92c6f592b0275ull, 0x4a7484aa6ea6e483ull, 0x5cb0a9dcbd41fbd4ull, 0x76f988da831153b5ull,
+    0x983e5152ee66dfabull, 0xa831c66d2db43210ull, 0xb00327c898fb213full, 0xbf597fc7beef0ee4ull,
+    0xc6e00bf33da88fc2ull, 0xd5a79147930aa725ull, 0x06ca6351e003826full, 0x142929670a0e6e70ull,
+    0x27b70a8546d22ffcull, 0x2e1b21385c26c926ull, 0x4d2c6dfc5ac42aedull, 0x53380d139d95b3dfull,
+    0x650a73548baf63deull, 0x766a0abb3c77b2a8ull, 0x81c2c92e47edaee6ull, 0x92722c851482353bull,
+    0xa2bfe8a14cf10364ull, 0xa81a664bbc423001ull, 0xc24b8b70d0f89791ull, 0xc76c51a30654be30ull,
+    0xd192e819d6ef5218ull, 0xd69906245565a910ull, 0xf40e35855771202aull, 0x106aa07032bbd1b8ull,
+    0x19a4c116b8d2d0c8ull, 0x1e376c085141ab53ull, 0x2748774cdf8eeb99ull, 0x34b0bcb5e19b48a8ull,
+    0x391c0cb3c5c95a63ull, 0x4ed8aa4ae3418acbull, 0x5b9cca4f7763e373ull, 0x682e6ff3d6b2b8a3ull,
+    0x748f82ee5defb2fcull, 0x78a5636f43172f60ull, 0x84c87814a1f0ab72ull, 0x8cc702081a6439ecull,
+    0x90befffa23631e28ull, 0xa4506cebde82bde9ull, 0xbef9a3f7b2c67915ull, 0xc67178f2e372532bull,
+    0xca273eceea26619cull, 0xd186b8c721c0c207ull, 0xeada7dd6cde0eb1eull, 0xf57d4f7fee6ed178ull,
+    0x06f067aa72176fbaull, 0x0a637dc5a2c898a6ull, 0x113f9804bef90daeull, 0x1b710b35131c471bull,
+    0x28db77f523047d84ull, 0x32caab7b40c72493ull, 0x3c9ebe0a15c9bebcull, 0x431d67c49c100d4cull,
+    0x4cc5d4becb3e42b6ull, 0x597f299cfc657e2aull, 0x5fcb6fab3ad6faecull, 0x6c44198c4a475817ull,
+};
+
+inline uint64_t ror64(uint64_t x, int n)
+{
+    return x >> n | x << (64 - n);
+}
+
+inline uint64_t load_be64(const uint8_t *p)
+{
+    uint64_t x;
+    memcpy(&x, p, sizeof(x));
+    return __builtin_bswap64(x);
+}
+
+// h = compression of nblocks 128-byte blocks at p into h
+void sha512_compress(uint64_t h[8], const uint8_t *p, size_t nblocks)
+{
+    for (size_t blk = 0; blk < nblocks; blk++, p += SHA_BLOCK)
+    {
+        uint64_t w[16];
+        uint64_t s[8];
+        memcpy(s, h, sizeof(s));
+        for (int t = 0; t < 80; t++)
+        {
+            if (t < 16)
+                w[t] = load_be64(p + 8 * t);
+            else
+            {
+                uint64_t w15 = w[(t - 15) & 15], w2 = w[(t - 2) & 15];
+                w[t & 15] += (ror64(w15, 1) ^ ror64(w15, 8) ^ (w15 >> 7)) + w[(t - 7) & 15] +
+                             (ror64(w2, 19) ^ ror64(w2, 61) ^ (w2 >> 6));
+            }
+            uint64_t t1 = s[7] + (ror64(s[4], 14) ^ ror64(s[4], 18) ^ ror64(s[4], 41)) +
+                          ((s[4] & s[5]) ^ (~s[4] & s[6])) + K512[t] + w[t & 15];
+            uint64_t t2 = (ror64(s[0], 28) ^ ror64(s[0], 34) ^ ror64(s[0], 39)) +
+                          ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+            memmove(s + 1, s, 7 * sizeof(uint64_t));
+            s[4] += t1;
+            s[0] = t1 + t2;
+        }
+        for (int j = 0; j < 8; j++)
+            h[j] += s[j];
+    }
+}
+
+// md = the digest of {body, tail} from the midstate h of the body, for a
+// 64-byte tail and a body of body_len bytes, a multiple of SHA_BLOCK
+void sha512_finish(const uint64_t h[8], const uint8_t tail[SHA512_DIGEST_LENGTH], uint64_t body_len, uint8_t *md)
+{
+    uint8_t last[SHA_BLOCK] = {0};
+    memcpy(last, tail, SHA512_DIGEST_LENGTH);
+    last[SHA512_DIGEST_LENGTH] = 0x80;
+    uint64_t bits = __builtin_bswap64((body_len + SHA512_DIGEST_LENGTH) * 8);
+    memcpy(last + SHA_BLOCK - 8, &bits, sizeof(bits));
+    uint64_t s[8];
+    memcpy(s, h, sizeof(s));
+    sha512_compress(s, last, 1);
+    for (int j = 0; j < 8; j++)
+    {
+        uint64_t x = __builtin_bswap64(s[j]);
+        memcpy(md + 8 * j, &x, sizeof(x));
+    }
+}
+
+// multi-buffer compression: lane l advances h[l] over nblocks blocks at p[l];
+// the lanes run the rounds side by side in one 64-bit vector element each and
+// gather their message words from their own buffers
+__attribute__((target("avx512f,avx512bw"))) void sha512_compress_x8(uint64_t (*h)[8], const uint8_t *const *p,
+                                                                    size_t nblocks)
+{
+    const __m512i bswap = _mm512_broadcast_i32x4(_mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8));
+    const __m512i hidx = _mm512_setr_epi64(0, 8, 16, 24, 32, 40, 48, 56);
+    __m512i off = _mm512_sub_epi64(_mm512_loadu_si512(p), _mm512_set1_epi64((int64_t)p[0]));
+    __m512i s[8];
+    for (int j = 0; j < 8; j++)
+        s[j] = _mm512_i64gather_epi64(hidx, &h[0][j], 8);
+    for (size_t blk = 0; blk < nblocks; blk++)
+    {
+        const uint8_t *base = p[0] + blk * SHA_BLOCK;
+        __m512i w[16];
+        __m512i a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], hh = s[7];
+        for (int t = 0; t < 80; t++)
+        {
+            if (t < 16)
+                w[t] = _mm512_shuffle_epi8(_mm512_i64gather_epi64(off, base + 8 * t, 1), bswap);
+            else
+            {
+                __m512i w15 = w[(t - 15) & 15], w2 = w[(t - 2) & 15];
+                __m512i s0 = _mm512_ternarylogic_epi64(_mm512_ror_epi64(w15, 1), _mm512_ror_epi64(w15, 8),
+                                                       _mm512_srli_epi64(w15, 7), 0x96);
+                __m512i s1 = _mm512_ternarylogic_epi64(_mm512_ror_epi64(w2, 19), _mm512_ror_epi64(w2, 61),
+                                                       _mm512_srli_epi64(w2, 6), 0x96);
+                w[t & 15] = _mm512_add_epi64(_mm512_add_epi64(w[t & 15], s0),
+                                             _mm512_add_epi64(w[(t - 7) & 15], s1));
+            }
+            __m512i S1 = _mm512_ternarylogic_epi64(_mm512_ror_epi64(e, 14), _mm512_ror_epi64(e, 18),
+                                                   _mm512_ror_epi64(e, 41), 0x96);
+            __m512i t1 = _mm512_add_epi64(_mm512_add_epi64(hh, S1),
+                                          _mm512_add_epi64(_mm512_ternarylogic_epi64(e, f, g, 0xca),
+                                                           _mm512_add_epi64(_mm512_set1_epi64(K512[t]), w[t & 15])));
+            __m512i S0 = _mm512_ternarylogic_epi64(_mm512_ror_epi64(a, 28), _mm512_ror_epi64(a, 34),
+                                                   _mm512_ror_epi64(a, 39), 0x96);
+            __m512i t2 = _mm512_add_epi64(S0, _mm512_ternarylogic_epi64(a, b, c, 0xe8));
+            hh = g;
+            g = f;
+            f = e;
+            e = _mm512_add_epi64(d, t1);
+            d = c;
+            c = b;
+            b = a;
+            a = _mm512_add_epi64(t1, t2);
+        }
+        s[0] = _mm512_add_epi64(s[0], a);
+        s[1] = _mm512_add_epi64(s[1], b);
+        s[2] = _mm512_add_epi64(s[2], c);
+        s[3] = _mm512_add_epi64(s[3], d);
+        s[4] = _mm512_add_epi64(s[4], e);
+        s[5] = _mm512_add_epi64(s[5], f);
+        s[6] = _mm512_add_epi64(s[6], g);
+        s[7] = _mm512_add_epi64(s[7], hh);
+    }
+    for (int j = 0; j < 8; j++)
+        _mm512_i64scatter_epi64(&h[0][j], hidx, s[j], 8);
+}
+
+__attribute__((target("avx2"))) inline __m256i ror256(__m256i x, int n)
+{
+    return _mm256_or_si256(_mm256_srli_epi64(x, n), _mm256_slli_epi64(x, 64 - n));
+}
+
+__attribute__((target("avx2"))) void sha512_compress_x4(uint64_t (*h)[8], const uint8_t *const *p, size_t nblocks)
+{
+    const __m256i bswap = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2,
+                                           1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    __m256i off = _mm256_sub_epi64(_mm256_loadu_si256((const __m256i *)p), _mm256_set1_epi64x((int64_t)p[0]));
+    __m256i s[8];
+    for (int j = 0; j < 8; j++)
+        s[j] = _mm256_setr_epi64x(h[0][j], h[1][j], h[2][j], h[3][j]);
+    for (size_t blk = 0; blk < nblocks; blk++)
+    {
+        const long long *base = (const long long *)(p[0] + blk * SHA_BLOCK);
+        __m256i w[16];
+        __m256i a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], hh = s[7];
+        for (int t = 0; t < 80; t++)
+        {
+            if (t < 16)
+                w[t] = _mm256_shuffle_epi8(_mm256_i64gather_epi64(base + t, off, 1), bswap);
+            else
+            {
+                __m256i w15 = w[(t - 15) & 15], w2 = w[(t - 2) & 15];
+                __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(ror256(w15, 1), ror256(w15, 8)),
+                                              _mm256_srli_epi64(w15, 7));
+                __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(ror256(w2, 19), ror256(w2, 61)),
+                                              _mm256_srli_epi64(w2, 6));
+                w[t & 15] = _mm256_add_epi64(_mm256_add_epi64(w[t & 15], s0),
+                                             _mm256_add_epi64(w[(t - 7) & 15], s1));
+            }
+            __m256i S1 = _mm256_xor_si256(_mm256_xor_si256(ror256(e, 14), ror256(e, 18)), ror256(e, 41));
+            __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+            __m256i t1 = _mm256_add_epi64(_mm256_add_epi64(hh, S1),
+                                          _mm256_add_epi64(ch, _mm256_add_epi64(_mm256_set1_epi64x(K512[t]), w[t & 15])));
+            __m256i S0 = _mm256_xor_si256(_mm256_xor_si256(ror256(a, 28), ror256(a, 34)), ror256(a, 39));
+            __m256i maj = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b)));
+            __m256i t2 = _mm256_add_epi64(S0, maj);
+            hh = g;
+            g = f;
+            f = e;
+            e = _mm256_add_epi64(d, t1);
+            d = c;
+            c = b;
+            b = a;
+            a = _mm256_add_epi64(t1, t2);
+        }
+        s[0] = _mm256_add_epi64(s[0], a);
+        s[1] = _mm256_add_epi64(s[1], b);
+        s[2] = _mm256_add_epi64(s[2], c);
+        s[3] = _mm256_add_epi64(s[3], d);
+        s[4] = _mm256_add_epi64(s[4], e);
+        s[5] = _mm256_add_epi64(s[5], f);
+        s[6] = _mm256_add_epi64(s[6], g);
+        s[7] = _mm256_add_epi64(s[7], hh);
+    }
+    for (int j = 0; j < 8; j++)
+    {
+        alignas(32) uint64_t v[4];
+        _mm256_store_si256((__m256i *)v, s[j]);
+        for (int l = 0; l < 4; l++)
+            h[l][j] = v[l];
+    }
+}
+
+void sha512_compress_x1(uint64_t (*h)[8], const uint8_t *const *p, size_t nblocks)
+{
+    sha512_compress(h[0], p[0], nblocks);
+}
+
+// a midstate engine hashes the bodies of lanes blocks at once
+struct Sha512Engine
+{
+    const char *name;
+    int lanes;
+    void (*compress)(uint64_t (*h)[8], const uint8_t *const *p, size_t nblocks);
+};
+
+const Sha512Engine engines[] = {
+    {"avx512", 8, sha512_compress_x8},
+    {"avx2", 4, sha512_compress_x4},
+    {"scalar", 1, sha512_compress_x1},
+};
+
+// the widest engine the cpu runs, CHECKSUM_ENGINE=avx2|scalar forces a
+// narrower one
+const Sha512Engine &select_engine()
+{
+    __builtin_cpu_init();
+    bool ok[3] = {__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"),
+                  __builtin_cpu_supports("avx2") != 0, true};
+    const char *env = getenv("CHECKSUM_ENGINE");
+    for (int i = 0; env && i < 3; i++)
+    {
+        if (ok[i] && strcmp(env, engines[i].name) == 0)
+            return engines[i];
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        if (ok[i])
+            return engines[i];
+    }
+    return engines[2];
+}
+
+// starts reading blocks [i0, i0 + count) of the view into buf; the request
+// stops at the end of the file, nonblocking reads across it hang or misreport
+// their count in some MPI-IO implementations
+void post_read(MPI_File fh, int64_t i0, int count, int rank, int nprocs, size_t file_size, uint8_t *buf,
+               MPI_Request *req)
+{
+    size_t last = ((i0 + count - 1) * nprocs + rank) * BLOCK_SIZE;
+    int bytes = (count - 1) * BLOCK_SIZE + std::min(BLOCK_SIZE, file_size - last);
+    MPI_File_iread_at(fh, i0 * BLOCK_SIZE, buf, bytes, MPI_BYTE, req);
+}
+
+// waits for a post_read(), zero padding a short last block
+void wait_read(MPI_Request *req, int count, uint8_t *buf)
+{
+    MPI_Status status;
+    int got = 0;
+    MPI_Wait(req, &status);
+    MPI_Get_count(&status, MPI_BYTE, &got);
+    got = std::max(got, 0);
+    memset(buf + got, 0, count * BLOCK_SIZE - got);
+}
+
+// midstate mode: the midstates of all blocks are independent, so every rank
+// hashes a contiguous range of blocks and gathers the midstates on rank 0,
+// which runs the chain of the final compressions alone (one compression per
+// block); inside a rank a reader thread streams the range with large preads,
+// outside of MPI, into a fixed pool of aligned buffers, and a pool of hashing
+// threads takes the filled buffers from a bounded queue and hands them back,
+// so one rank per node can keep all of its cores and the reads busy
+
+// blocking fifo of at most cap items
+template <typename T>
+struct BoundedQueue
+{
+    std::mutex m;
+    std::condition_variable not_full, not_empty;
+    std::deque<T> q;
+    size_t cap;
+    bool closed = false;
+
+    explicit BoundedQueue(size_t cap) : cap(cap)
+    {
+    }
+
+    void push(T x)
+    {
+        std::unique_lock<std::mutex> lock(m);
+        not_full.wait(lock, [&] { return q.size() < cap; });
+        q.push_back(x);
+        not_empty.notify_one();
+    }
+
+    // false once the queue is closed and drained
+    bool pop(T &x)
+    {
+        std::unique_lock<std::mutex> lock(m);
+        not_empty.wait(lock, [&] { return !q.empty() || closed; });
+        if (q.empty())
+            return false;
+        x = q.front();
+        q.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(m);
+        closed = true;
+        not_empty.notify_all();
+    }
+};
+
+// up to one engine group of consecutive blocks in a pool buffer
+struct Chunk
+{
+    uint8_t *buf = nullptr;
+    int64_t first = 0;
+    int count = 0;
+};
+
+// reads blocks [first, first + count) into buf, zero padding past the end of
+// the file
+void read_chunk(int fd, size_t file_size, const Chunk &c)
+{
+    size_t want = std::min(c.count * BLOCK_SIZE, file_size - c.first * BLOCK_SIZE);
+    size_t got = 0;
+    while (got < want)
+    {
+        ssize_t r = pread(fd, c.buf + got, want - got, c.first * BLOCK_SIZE + got);
+        if (r <= 0)
+            break;
+        got += r;
+    }
+    memset(c.buf + got, 0, c.count * BLOCK_SIZE - got);
+}
+
+// midstates of the blocks of c into mid[0, c.count)
+void hash_chunk(const Sha512Engine &engine, const Chunk &c, uint64_t (*mid)[8])
+{
+    const uint8_t *lane_block[8];
+    uint64_t h[8][8];
+    for (int l = 0; l < engine.lanes; l++)
+    {
+        // lanes past the last block rehash the first one, unused
+        memcpy(h[l], SHA512_IV, sizeof(SHA512_IV));
+        lane_block[l] = c.buf + (l < c.count ? l : 0) * BLOCK_SIZE;
+    }
+    engine.compress(h, lane_block, BLOCK_SIZE / SHA_BLOCK);
+    memcpy(mid, h, c.count * sizeof(h[0]));
+}
+
+// hashing threads per rank when not given: the cores of the node shared by
+// its ranks
+int default_threads()
+{
+    MPI_Comm node;
+    int local;
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node);
+    MPI_Comm_size(node, &local);
+    MPI_Comm_free(&node);
+    return std::max(1, (int)std::thread::hardware_concurrency() / local);
+}
+
+// the checksum of the file on rank 0, threads hashing threads per rank (0:
+// default_threads())
+void checksum_midstate(const char *path, size_t file_size, int rank, int nprocs, int threads, uint8_t *md)
+{
+    int64_t num_block_total = (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int64_t first = num_block_total * rank / nprocs;
+    int64_t last = num_block_total * (rank + 1) / nprocs;
+    std::vector<uint64_t> buf(8 * (rank == 0 ? num_block_total : last - first));
+    uint64_t(*mid)[8] = (uint64_t(*)[8])buf.data();
+    if (threads <= 0)
+        threads = default_threads();
+
+    // two buffers per hashing thread: one being hashed, one being read
+    const Sha512Engine &engine = select_engine();
+    int lanes = engine.lanes;
+    int nbuf = 2 * threads;
+    uint8_t *pool = (uint8_t *)aligned_alloc(64, nbuf * lanes * BLOCK_SIZE);
+    BoundedQueue<uint8_t *> free_bufs(nbuf);
+    BoundedQueue<Chunk> filled(nbuf);
+    for (int b = 0; b < nbuf; b++)
+        free_bufs.push(pool + b * lanes * BLOCK_SIZE);
+
+    int fd = open(path, O_RDONLY);
+    std::thread reader([&] {
+        for (int64_t i0 = first; i0 < last; i0 += lanes)
+        {
+            Chunk c;
+            if (!free_bufs.pop(c.buf))
+                break;
+            c.first = i0;
+            c.count = std::min<int64_t>(lanes, last - i0);
+            read_chunk(fd, file_size, c);
+            filled.push(c);
+        }
+        filled.close();
+    });
+    std::vector<std::thread> hashers;
+    for (int t = 0; t < threads; t++)
+    {
+        hashers.emplace_back([&] {
+            Chunk c;
+            while (filled.pop(c))
+            {
+                hash_chunk(engine, c, mid + c.first - first);
+                free_bufs.push(c.buf);
+            }
+        });
+    }
+    reader.join();
+    for (std::thread &th : hashers)
+        th.join();
+    close(fd);
+    free(pool);
+
+    std::vector<int> counts(nprocs), displs(nprocs);
+    for (int r = 0; r < nprocs; r++)
+    {
+        displs[r] = num_block_total * r / nprocs * sizeof(mid[0]);
+        counts[r] = num_block_total * (r + 1) / nprocs * sizeof(mid[0]) - displs[r];
+    }
+    MPI_Gatherv(rank == 0 ? MPI_IN_PLACE : mid, counts[rank], MPI_BYTE, mid, counts.data(),
+                displs.data(), MPI_BYTE, 0, MPI_COMM_WORLD);
+
+    if (rank == 0)
+    {
+        SHA512(nullptr, 0, md);
+        for (int64_t i = 0; i < num_block_total; i++)
+            sha512_finish(mid[i], md, BLOCK_SIZE, md);
+    }
+}
+
 int main(int argc, char *argv[])
 {
 
@@ -45,13 +513,29 @@ int main(int argc, char *argv[])
     {
         if (argc < 3)
         {
-            std::cout << "Usage: " << argv[0] << " <input_file> <output_file>"
+            std::cout << "Usage: " << argv[0] << " <input_file> <output_file> [-m] [-t threads] [-d depth]"
                       << std::endl;
             MPI_Abort(MPI_COMM_WORLD, 1);
         }
     }
     input_path = argv[1];
     output_path = argv[2];
+
+    // -m: midstate mode, -t threads: hashing threads per rank in it, by
+    // default the cores of the node over its ranks; -d depth: block groups
+    // buffered by the ring mode, 3 reads ahead of the hashing by two
+    bool midstate_mode = false;
+    int threads = 0;
+    int depth = 3;
+    for (int i = 3; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-m") == 0)
+            midstate_mode = true;
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+            threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+            depth = std::max(1, atoi(argv[++i]));
+    }
     if (rank == 0)
     {
         file_size = fs::file_size(input_path);
@@ -59,6 +543,21 @@ int main(int argc, char *argv[])
     }
 
     MPI_Bcast(&file_size, 1, MPI_INT64_T, 0, MPI_COMM_WORLD);
+
+    if (midstate_mode)
+    {
+        uint8_t resultdigest[SHA512_DIGEST_LENGTH];
+        checksum_midstate(input_path.c_str(), file_size, rank, nprocs, threads, resultdigest);
+        if (rank == 0)
+        {
+            std::ofstream output_file(output_path);
+            print_checksum(output_file, resultdigest, SHA512_DIGEST_LENGTH);
+        }
+        EVP_MD_free(sha512);
+        EVP_MD_CTX_free(ctx);
+        MPI_Finalize();
+        return 0;
+    }
     num_block_total = (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
     num_block = get_num_block(rank, nprocs, num_block_total);
 
@@ -75,60 +574,112 @@ int main(int argc, char *argv[])
                   MPI_INFO_NULL, &fh);
     MPI_File_set_view(fh, offset, MPI_BYTE, filetype, "native", MPI_INFO_NULL);
 
+    // blocks go through in groups of engine.lanes: the bodies of a group are
+    // hashed side by side by the multi-buffer engine, then the group is
+    // finished block by block as the previous digests come around the ring;
+    // the scalar engine keeps hashing one body with libcrypto while it waits;
+    // the reads of the next depth - 1 groups are in flight meanwhile, into a
+    // ring of depth group buffers that is recycled as groups are hashed
+    const Sha512Engine &engine = select_engine();
+    int lanes = engine.lanes;
+    int num_group = (num_block + lanes - 1) / lanes;
+    uint8_t *pool = (uint8_t *)aligned_alloc(64, depth * lanes * BLOCK_SIZE);
+    std::vector<MPI_Request> reads(depth, MPI_REQUEST_NULL);
+    for (int g = 0; g < std::min(depth, num_group); g++)
+    {
+        post_read(fh, g * lanes, std::min(lanes, num_block - g * lanes), rank, nprocs, file_size,
+                  pool + g * lanes * BLOCK_SIZE, &reads[g]);
+    }
+    uint64_t midstate[8][8];
+    const uint8_t *lane_block[8];
+    if (rank == 0)
+        std::cout << "engine: " << engine.name << std::endl;
+
     uint8_t prevdigest[SHA512_DIGEST_LENGTH];
-    uint8_t outdigest[SHA512_DIGEST_LENGTH];
-    MPI_Request request[2] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL};
-    int nblk_index = 0;
+    uint8_t outdigest[8][SHA512_DIGEST_LENGTH];
+    MPI_Request request[8];
+    std::fill(request, request + 8, MPI_REQUEST_NULL);
 
-    uint8_t curr_block[BLOCK_SIZE];
-    for (int i = 0; i < num_block; i++)
+    for (int g = 0; g < num_group; g++)
     {
-        MPI_File_read(fh, curr_block, BLOCK_SIZE, MPI_BYTE, MPI_STATUS_IGNORE);
-
-        unsigned int len = 0;
+        int i0 = g * lanes;
+        int nl = std::min(lanes, num_block - i0);
+        uint8_t *blocks = pool + g % depth * lanes * BLOCK_SIZE;
+        wait_read(&reads[g % depth], nl, blocks);
 
-        if (rank == 0 && i == 0)
+        if (lanes > 1)
         {
-            SHA512(nullptr, 0, prevdigest);
+            for (int l = 0; l < lanes; l++)
+            {
+                // lanes past the last block rehash the first one, unused
+                memcpy(midstate[l], SHA512_IV, sizeof(SHA512_IV));
+                lane_block[l] = blocks + (l < nl ? l : 0) * BLOCK_SIZE;
+            }
+            engine.compress(midstate, lane_block, BLOCK_SIZE / SHA_BLOCK);
         }
         else
         {
-            // receive the checksum of prev data block
-            MPI_Irecv(prevdigest, SHA512_DIGEST_LENGTH, MPI_BYTE,
-                      (rank == 0 ? nprocs - 1 : rank - 1), 1, MPI_COMM_WORLD,
-                      &request[0]);
+            EVP_DigestInit_ex(ctx, sha512, nullptr);
+            EVP_DigestUpdate(ctx, blocks, BLOCK_SIZE);
         }
 
-        EVP_DigestInit_ex(ctx, sha512, nullptr);
-
-        EVP_DigestUpdate(ctx, curr_block, BLOCK_SIZE);
-
-        MPI_Waitall(2, request, MPI_STATUSES_IGNORE);
-
-        EVP_DigestUpdate(ctx, prevdigest, SHA512_DIGEST_LENGTH);
-
-        EVP_DigestFinal_ex(ctx, outdigest, &len);
-
-        if (i * nprocs + rank == num_block_total - 1)
+        // the bodies are hashed, the buffer takes the group depth ahead
+        if (g + depth < num_group)
         {
-            // send the result to rank 0
-            MPI_Send(outdigest, SHA512_DIGEST_LENGTH, MPI_BYTE, 0, 2, MPI_COMM_WORLD);
+            int n = g + depth;
+            post_read(fh, n * lanes, std::min(lanes, num_block - n * lanes), rank, nprocs, file_size, blocks,
+                      &reads[g % depth]);
         }
-        else
+
+        for (int l = 0; l < nl; l++)
         {
-            // send to checksum to the next data block
-            MPI_Isend(outdigest, SHA512_DIGEST_LENGTH, MPI_BYTE, (rank + 1) % nprocs,
-                      1, MPI_COMM_WORLD, &request[1]);
+            int i = i0 + l;
+            if (rank == 0 && i == 0)
+            {
+                SHA512(nullptr, 0, prevdigest);
+            }
+            else
+            {
+                // receive the checksum of prev data block
+                MPI_Recv(prevdigest, SHA512_DIGEST_LENGTH, MPI_BYTE, (rank == 0 ? nprocs - 1 : rank - 1), 1,
+                         MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            }
+            MPI_Wait(&request[l], MPI_STATUS_IGNORE);
+
+            if (lanes > 1)
+            {
+                sha512_finish(midstate[l], prevdigest, BLOCK_SIZE, outdigest[l]);
+            }
+            else
+            {
+                unsigned int len = 0;
+                EVP_DigestUpdate(ctx, prevdigest, SHA512_DIGEST_LENGTH);
+                EVP_DigestFinal_ex(ctx, outdigest[l], &len);
+            }
+
+            if ((int64_t)i * nprocs + rank == num_block_total - 1)
+            {
+                // send the result to rank 0
+                MPI_Send(outdigest[l], SHA512_DIGEST_LENGTH, MPI_BYTE, 0, 2, MPI_COMM_WORLD);
+            }
+            else
+            {
+                // send to checksum to the next data block
+                MPI_Isend(outdigest[l], SHA512_DIGEST_LENGTH, MPI_BYTE, (rank + 1) % nprocs, 1, MPI_COMM_WORLD,
+                          &request[l]);
+            }
         }
     }
+    MPI_Waitall(8, request, MPI_STATUSES_IGNORE);
+    free(pool);
 
     MPI_File_close(&fh);
 
     if (rank == 0 && num_block == 0)
     {
         // deal with the situation that file_size is 0
-        SHA512(nullptr, 0, outdigest);
-        MPI_Send(outdigest, SHA512_DIGEST_LENGTH, MPI_BYTE, 0, 2, MPI_COMM_WORLD);
+        SHA512(nullptr, 0, outdigest[0]);
+        MPI_Send(outdigest[0], SHA512_DIGEST_LENGTH, MPI_BYTE, 0, 2, MPI_COMM_WORLD);
     }
 
     if (rank == 0)
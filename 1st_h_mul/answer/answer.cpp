@@ -3,155 +3,1224 @@
 #include <omp.h>
 #include <immintrin.h>
 #include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <vector>
 
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
-constexpr int rb = 32;
-constexpr int nb = 8;
-constexpr int cb = nb * rb;
+using std::copy;
+using std::fill;
+using std::find;
+using std::max;
+using std::min;
+using std::vector;
 
-void mul32ker(double *__restrict a, double *__restrict b, double *__restrict c)
+// BLIS-style blocking: C[mr x nr] micro-tiles live in registers, an MC x KC
+// block of A is packed per thread and stays in L2, a KC x NC panel of B is
+// packed once, shared by all threads and stays in L3; a KC x nr micro-panel of
+// B is reused from L1 across the mr row strips of the A block
+constexpr int MC = 256;
+constexpr int KC = 256;
+constexpr int NC = 4096;
+
+// a micro-kernel computes c[mr x nr] += a[mr x kc] * b[kc x nr], a is packed
+// k-major with MR values per k, b with NR values per k, both zero padded past
+// mr and nr; c is row-major with stride ldc and only its mr x nr corner is
+// touched; packa packs mc rows of a ... x kc block of stride lda into MR row
+// strips, packb packs nr <= NR columns of a kc x ... block of stride ldb; T is
+// the packed element type, C always stays double; kc is padded to a multiple
+// of KP in the packed panels
+template <typename T>
+struct KernelT
+{
+    const char *name;
+    int MR, NR, KP;
+    void (*ker)(const T *__restrict a, const T *__restrict b, double *__restrict c, uint64_t ldc, int kc, int mr,
+                int nr);
+    void (*packa)(T *__restrict dst, const double *__restrict src, uint64_t lda, int mc, int kc);
+    void (*packb)(T *__restrict dst, const double *__restrict src, uint64_t ldb, int kc, int nr);
+};
+
+using Kernel = KernelT<double>;
+
+// pack src[mc x kc] into MR row strips, k-major inside a strip, the last strip
+// is zero padded to MR rows
+template <typename T, int MR>
+void packa_generic(T *__restrict dst, const double *__restrict src, uint64_t lda, int mc, int kc)
 {
-    for (int i = 0; i < rb; i += 32)
+    for (int ir = 0; ir < mc; ir += MR)
     {
-        for (int j = 0; j < rb; j += 4)
+        int mr = min(MR, mc - ir);
+        for (int k = 0; k < kc; k++)
         {
-            __m512d ar;
-            __m512d br[4];
-            __m512d cr[16];
-            for (int m = 0; m < 4; m++)
+            for (int m = 0; m < MR; m++)
             {
-                cr[m * 4] = _mm512_loadu_pd(c + (j + m) * rb + i);
-                cr[m * 4 + 1] = _mm512_loadu_pd(c + (j + m) * rb + i + 8);
-                cr[m * 4 + 2] = _mm512_loadu_pd(c + (j + m) * rb + i + 16);
-                cr[m * 4 + 3] = _mm512_loadu_pd(c + (j + m) * rb + i + 24);
+                dst[m] = m < mr ? src[(ir + m) * lda + k] : 0.0;
             }
+            dst += MR;
+        }
+    }
+}
+
+template <typename T, int NR>
+void packb_generic(T *__restrict dst, const double *__restrict src, uint64_t ldb, int kc, int nr)
+{
+    for (int k = 0; k < kc; k++)
+    {
+        for (int n = 0; n < NR; n++)
+        {
+            dst[k * NR + n] = n < nr ? src[k * ldb + n] : 0.0;
+        }
+    }
+}
 
-            for (int k = 0; k < rb; k++)
+// 8 x 16, two zmm per row, 16 accumulators
+__attribute__((target("avx512f"))) void mulker_avx512(const double *__restrict a, const double *__restrict b,
+                                                      double *__restrict c, uint64_t ldc, int kc, int mr, int nr)
+{
+    constexpr int MR = 8;
+    constexpr int NR = 16;
+    __mmask8 mask0 = nr >= 8 ? 0xff : (1 << nr) - 1;
+    __mmask8 mask1 = nr >= 16 ? 0xff : nr > 8 ? (1 << (nr - 8)) - 1 : 0;
+    __m512d cr[MR][2];
+    for (int m = 0; m < MR; m++)
+    {
+        cr[m][0] = _mm512_setzero_pd();
+        cr[m][1] = _mm512_setzero_pd();
+        if (m < mr)
+        {
+            cr[m][0] = _mm512_maskz_loadu_pd(mask0, c + m * ldc);
+            cr[m][1] = _mm512_maskz_loadu_pd(mask1, c + m * ldc + 8);
+        }
+    }
+    for (int k = 0; k < kc; k++)
+    {
+        __m512d b0 = _mm512_load_pd(b + k * NR);
+        __m512d b1 = _mm512_load_pd(b + k * NR + 8);
+        for (int m = 0; m < MR; m++)
+        {
+            __m512d ar = _mm512_set1_pd(a[k * MR + m]);
+            cr[m][0] = _mm512_fmadd_pd(ar, b0, cr[m][0]);
+            cr[m][1] = _mm512_fmadd_pd(ar, b1, cr[m][1]);
+        }
+    }
+    for (int m = 0; m < mr; m++)
+    {
+        _mm512_mask_storeu_pd(c + m * ldc, mask0, cr[m][0]);
+        _mm512_mask_storeu_pd(c + m * ldc + 8, mask1, cr[m][1]);
+    }
+}
+
+__attribute__((target("avx512f"))) void packb_avx512(double *__restrict dst, const double *__restrict src,
+                                                     uint64_t ldb, int kc, int nr)
+{
+    constexpr int NR = 16;
+    __mmask8 mask0 = nr >= 8 ? 0xff : (1 << nr) - 1;
+    __mmask8 mask1 = nr >= 16 ? 0xff : nr > 8 ? (1 << (nr - 8)) - 1 : 0;
+    for (int k = 0; k < kc; k++)
+    {
+        _mm512_store_pd(dst + k * NR, _mm512_maskz_loadu_pd(mask0, src + k * ldb));
+        _mm512_store_pd(dst + k * NR + 8, _mm512_maskz_loadu_pd(mask1, src + k * ldb + 8));
+    }
+}
+
+// 6 x 8, two ymm per row, 12 accumulators out of the 16 ymm registers
+__attribute__((target("avx2,fma"))) void mulker_avx2(const double *__restrict a, const double *__restrict b,
+                                                    double *__restrict c, uint64_t ldc, int kc, int mr, int nr)
+{
+    constexpr int MR = 6;
+    constexpr int NR = 8;
+    __m256i lane = _mm256_set_epi64x(3, 2, 1, 0);
+    __m256i mask0 = _mm256_cmpgt_epi64(_mm256_set1_epi64x(nr), lane);
+    __m256i mask1 = _mm256_cmpgt_epi64(_mm256_set1_epi64x(nr - 4), lane);
+    __m256d cr[MR][2];
+    for (int m = 0; m < MR; m++)
+    {
+        cr[m][0] = _mm256_setzero_pd();
+        cr[m][1] = _mm256_setzero_pd();
+        if (m < mr)
+        {
+            cr[m][0] = _mm256_maskload_pd(c + m * ldc, mask0);
+            cr[m][1] = _mm256_maskload_pd(c + m * ldc + 4, mask1);
+        }
+    }
+    for (int k = 0; k < kc; k++)
+    {
+        __m256d b0 = _mm256_load_pd(b + k * NR);
+        __m256d b1 = _mm256_load_pd(b + k * NR + 4);
+        for (int m = 0; m < MR; m++)
+        {
+            __m256d ar = _mm256_broadcast_sd(a + k * MR + m);
+            cr[m][0] = _mm256_fmadd_pd(ar, b0, cr[m][0]);
+            cr[m][1] = _mm256_fmadd_pd(ar, b1, cr[m][1]);
+        }
+    }
+    for (int m = 0; m < mr; m++)
+    {
+        _mm256_maskstore_pd(c + m * ldc, mask0, cr[m][0]);
+        _mm256_maskstore_pd(c + m * ldc + 4, mask1, cr[m][1]);
+    }
+}
+
+// portable 4 x 4, left to the compiler
+void mulker_scalar(const double *__restrict a, const double *__restrict b, double *__restrict c, uint64_t ldc,
+                   int kc, int mr, int nr)
+{
+    constexpr int MR = 4;
+    constexpr int NR = 4;
+    double cr[MR][NR] = {};
+    for (int k = 0; k < kc; k++)
+    {
+        for (int m = 0; m < MR; m++)
+        {
+            for (int n = 0; n < NR; n++)
             {
-                br[0] = _mm512_loadu_pd(b + k * rb + i);
-                br[1] = _mm512_loadu_pd(b + k * rb + i + 8);
-                br[2] = _mm512_loadu_pd(b + k * rb + i + 16);
-                br[3] = _mm512_loadu_pd(b + k * rb + i + 24);
-                for (int m = 0; m < 4; m++)
-                {
-                    ar = _mm512_set1_pd(a[j * rb + m * rb + k]);
-                    cr[m * 4] = _mm512_fmadd_pd(ar, br[0], cr[m * 4]);
-                    cr[m * 4 + 1] = _mm512_fmadd_pd(ar, br[1], cr[m * 4 + 1]);
-                    cr[m * 4 + 2] = _mm512_fmadd_pd(ar, br[2], cr[m * 4 + 2]);
-                    cr[m * 4 + 3] = _mm512_fmadd_pd(ar, br[3], cr[m * 4 + 3]);
-                }
+                cr[m][n] += a[k * MR + m] * b[k * NR + n];
             }
+        }
+    }
+    for (int m = 0; m < mr; m++)
+    {
+        for (int n = 0; n < nr; n++)
+        {
+            c[m * ldc + n] += cr[m][n];
+        }
+    }
+}
+
+const Kernel kernels[] = {
+    {"avx512", 8, 16, 1, mulker_avx512, packa_generic<double, 8>, packb_avx512},
+    {"avx2", 6, 8, 1, mulker_avx2, packa_generic<double, 6>, packb_generic<double, 8>},
+    {"scalar", 4, 4, 1, mulker_scalar, packa_generic<double, 4>, packb_generic<double, 4>},
+};
+
+// whether the cpu runs kernels[i]
+bool kernel_ok(int i)
+{
+    __builtin_cpu_init();
+    if (i == 0)
+        return __builtin_cpu_supports("avx512f");
+    if (i == 1)
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    return true;
+}
+
+// the widest kernel the cpu runs, MUL_KERNEL=avx2|scalar forces a narrower one
+const Kernel &select_kernel()
+{
+    const char *env = getenv("MUL_KERNEL");
+    for (int i = 0; env && i < 3; i++)
+    {
+        if (kernel_ok(i) && strcmp(env, kernels[i].name) == 0)
+            return kernels[i];
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        if (kernel_ok(i))
+            return kernels[i];
+    }
+    return kernels[2];
+}
+
+const Kernel &kernel = select_kernel();
+
+// mixed precision: fp32 inputs, or bf16 inputs, both multiplied with fp32
+// accumulation inside one KC block; every block is added into the fp64 C, so
+// rounding only builds up over KC terms; bf16 uses AVX512_BF16 dot products
+// where present and fp32 FMAs on bf16-rounded inputs otherwise
+enum class Precision
+{
+    FP64,
+    FP32,
+    BF16,
+};
 
-            for (int m = 0; m < 4; m++)
+// round to nearest even bf16, the upper half of the float bits
+inline uint16_t to_bf16(double x)
+{
+    float f = x;
+    uint32_t u;
+    memcpy(&u, &f, sizeof(u));
+    u += 0x7fff + ((u >> 16) & 1);
+    return u >> 16;
+}
+
+inline float bf16_round(double x)
+{
+    uint32_t u = (uint32_t)to_bf16(x) << 16;
+    float f;
+    memcpy(&f, &u, sizeof(f));
+    return f;
+}
+
+template <int MR>
+void packa_round(float *__restrict dst, const double *__restrict src, uint64_t lda, int mc, int kc)
+{
+    for (int ir = 0; ir < mc; ir += MR)
+    {
+        int mr = min(MR, mc - ir);
+        for (int k = 0; k < kc; k++)
+        {
+            for (int m = 0; m < MR; m++)
             {
-                _mm512_storeu_pd(c + (j + m) * rb + i, cr[m * 4]);
-                _mm512_storeu_pd(c + (j + m) * rb + i + 8, cr[m * 4 + 1]);
-                _mm512_storeu_pd(c + (j + m) * rb + i + 16, cr[m * 4 + 2]);
-                _mm512_storeu_pd(c + (j + m) * rb + i + 24, cr[m * 4 + 3]);
+                dst[m] = m < mr ? bf16_round(src[(ir + m) * lda + k]) : 0.0f;
             }
+            dst += MR;
         }
     }
 }
 
-void mulcb(double *__restrict a, double *__restrict b, double *__restrict c)
+template <int NR>
+void packb_round(float *__restrict dst, const double *__restrict src, uint64_t ldb, int kc, int nr)
 {
-    for (int i = 0; i < nb; i++)
+    for (int k = 0; k < kc; k++)
     {
-        for (int j = 0; j < nb; j++)
+        for (int n = 0; n < NR; n++)
         {
-            double *c_ = c + i * rb * cb + j * rb * rb;
-            for (int k = 0; k < nb; k++)
+            dst[k * NR + n] = n < nr ? bf16_round(src[k * ldb + n]) : 0.0f;
+        }
+    }
+}
+
+// bf16 panels hold k in pairs, {k, k + 1} of one row (A) or column (B) next
+// to each other, as the dot product instructions consume them
+template <int MR>
+void packa_bf16(uint16_t *__restrict dst, const double *__restrict src, uint64_t lda, int mc, int kc)
+{
+    for (int ir = 0; ir < mc; ir += MR)
+    {
+        int mr = min(MR, mc - ir);
+        for (int k = 0; k < kc; k += 2)
+        {
+            for (int m = 0; m < MR; m++)
             {
-                double *a_ = a + i * rb * cb + k * rb * rb;
-                double *b_ = b + k * rb * cb + j * rb * rb;
-                mul32ker(a_, b_, c_);
+                dst[2 * m] = m < mr ? to_bf16(src[(ir + m) * lda + k]) : 0;
+                dst[2 * m + 1] = m < mr && k + 1 < kc ? to_bf16(src[(ir + m) * lda + k + 1]) : 0;
             }
+            dst += 2 * MR;
+        }
+    }
+}
+
+template <int NR>
+void packb_bf16(uint16_t *__restrict dst, const double *__restrict src, uint64_t ldb, int kc, int nr)
+{
+    for (int k = 0; k < kc; k += 2)
+    {
+        for (int n = 0; n < NR; n++)
+        {
+            dst[2 * n] = n < nr ? to_bf16(src[k * ldb + n]) : 0;
+            dst[2 * n + 1] = n < nr && k + 1 < kc ? to_bf16(src[(k + 1) * ldb + n]) : 0;
         }
+        dst += 2 * NR;
     }
 }
 
-void moverb(double *__restrict dst, double *__restrict src)
+// c[0, min(nr, 16)) += the 16 float lanes of x
+__attribute__((target("avx512f"))) inline void addps_pd(double *c, __m512 x, int nr)
 {
-    _mm512_storeu_pd(dst, _mm512_loadu_pd(src));
-    _mm512_storeu_pd(dst + 8, _mm512_loadu_pd(src + 8));
-    _mm512_storeu_pd(dst + 16, _mm512_loadu_pd(src + 16));
-    _mm512_storeu_pd(dst + 24, _mm512_loadu_pd(src + 24));
+    __mmask8 mask0 = nr >= 8 ? 0xff : nr > 0 ? (1 << nr) - 1 : 0;
+    __mmask8 mask1 = nr >= 16 ? 0xff : nr > 8 ? (1 << (nr - 8)) - 1 : 0;
+    __m512d lo = _mm512_cvtps_pd(_mm512_castps512_ps256(x));
+    __m512d hi = _mm512_cvtps_pd(_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(x), 1)));
+    _mm512_mask_storeu_pd(c, mask0, _mm512_add_pd(_mm512_maskz_loadu_pd(mask0, c), lo));
+    _mm512_mask_storeu_pd(c + 8, mask1, _mm512_add_pd(_mm512_maskz_loadu_pd(mask1, c + 8), hi));
 }
 
-void loadcb(double *__restrict dst, double *__restrict src, uint64_t n)
+// 8 x 32 floats, two zmm per row, 16 accumulators
+__attribute__((target("avx512f"))) void mulker_avx512_fp32(const float *__restrict a, const float *__restrict b,
+                                                           double *__restrict c, uint64_t ldc, int kc, int mr,
+                                                           int nr)
 {
-    for (uint64_t i = 0; i < nb; i++)
+    constexpr int MR = 8;
+    constexpr int NR = 32;
+    __m512 cr[MR][2];
+    for (int m = 0; m < MR; m++)
     {
-        for (uint64_t m = 0; m < rb; m++)
+        cr[m][0] = _mm512_setzero_ps();
+        cr[m][1] = _mm512_setzero_ps();
+    }
+    for (int k = 0; k < kc; k++)
+    {
+        __m512 b0 = _mm512_load_ps(b + k * NR);
+        __m512 b1 = _mm512_load_ps(b + k * NR + 16);
+        for (int m = 0; m < MR; m++)
+        {
+            __m512 ar = _mm512_set1_ps(a[k * MR + m]);
+            cr[m][0] = _mm512_fmadd_ps(ar, b0, cr[m][0]);
+            cr[m][1] = _mm512_fmadd_ps(ar, b1, cr[m][1]);
+        }
+    }
+    for (int m = 0; m < mr; m++)
+    {
+        addps_pd(c + m * ldc, cr[m][0], nr);
+        addps_pd(c + m * ldc + 16, cr[m][1], nr - 16);
+    }
+}
+
+// 8 x 32 with vdpbf16ps, every instruction takes one k pair
+__attribute__((target("avx512f,avx512bf16"))) void mulker_avx512_bf16(const uint16_t *__restrict a,
+                                                                      const uint16_t *__restrict b,
+                                                                      double *__restrict c, uint64_t ldc, int kc,
+                                                                      int mr, int nr)
+{
+    constexpr int MR = 8;
+    constexpr int NR = 32;
+    __m512 cr[MR][2];
+    for (int m = 0; m < MR; m++)
+    {
+        cr[m][0] = _mm512_setzero_ps();
+        cr[m][1] = _mm512_setzero_ps();
+    }
+    for (int k = 0; k < kc; k += 2)
+    {
+        __m512bh b0 = (__m512bh)_mm512_load_si512(b + k * NR);
+        __m512bh b1 = (__m512bh)_mm512_load_si512(b + k * NR + 32);
+        for (int m = 0; m < MR; m++)
+        {
+            int pair;
+            memcpy(&pair, a + k * MR + 2 * m, sizeof(pair));
+            __m512bh ar = (__m512bh)_mm512_set1_epi32(pair);
+            cr[m][0] = _mm512_dpbf16_ps(cr[m][0], ar, b0);
+            cr[m][1] = _mm512_dpbf16_ps(cr[m][1], ar, b1);
+        }
+    }
+    for (int m = 0; m < mr; m++)
+    {
+        addps_pd(c + m * ldc, cr[m][0], nr);
+        addps_pd(c + m * ldc + 16, cr[m][1], nr - 16);
+    }
+}
+
+// portable 4 x 4 floats
+void mulker_scalar_fp32(const float *__restrict a, const float *__restrict b, double *__restrict c, uint64_t ldc,
+                        int kc, int mr, int nr)
+{
+    constexpr int MR = 4;
+    constexpr int NR = 4;
+    float cr[MR][NR] = {};
+    for (int k = 0; k < kc; k++)
+    {
+        for (int m = 0; m < MR; m++)
         {
-            for (uint64_t j = 0; j < nb; j++)
+            for (int n = 0; n < NR; n++)
             {
-                moverb(dst + i * rb * cb + j * rb * rb + m * rb, src + (i * rb + m) * n + j * rb);
+                cr[m][n] += a[k * MR + m] * b[k * NR + n];
             }
         }
     }
+    for (int m = 0; m < mr; m++)
+    {
+        for (int n = 0; n < nr; n++)
+        {
+            c[m * ldc + n] += cr[m][n];
+        }
+    }
+}
+
+// fp32 kernels, and the same kernels fed with bf16-rounded inputs
+const KernelT<float> kernels32[] = {
+    {"avx512", 8, 32, 1, mulker_avx512_fp32, packa_generic<float, 8>, packb_generic<float, 32>},
+    {"scalar", 4, 4, 1, mulker_scalar_fp32, packa_generic<float, 4>, packb_generic<float, 4>},
+};
+
+const KernelT<float> kernels16[] = {
+    {"avx512", 8, 32, 1, mulker_avx512_fp32, packa_round<8>, packb_round<32>},
+    {"scalar", 4, 4, 1, mulker_scalar_fp32, packa_round<4>, packb_round<4>},
+};
+
+const KernelT<uint16_t> kernelbf16 = {"avx512bf16", 8, 32, 2, mulker_avx512_bf16, packa_bf16<8>, packb_bf16<32>};
+
+// the AVX-512 flavours follow the fp64 selection, so MUL_KERNEL applies too
+const KernelT<float> &kernel32 = kernels32[&kernel == &kernels[0] ? 0 : 1];
+const KernelT<float> &kernel16 = kernels16[&kernel == &kernels[0] ? 0 : 1];
+const bool has_bf16 = &kernel == &kernels[0] && __builtin_cpu_supports("avx512bf16");
+
+// c[mc x nc] += packed a[mc x kc] * packed b[kc x nc]
+template <typename T>
+void mulcb(const KernelT<T> &ker, const T *__restrict a, const T *__restrict b, double *__restrict c, uint64_t ldc,
+           int mc, int nc, int kc)
+{
+    for (int jr = 0; jr < nc; jr += ker.NR)
+    {
+        for (int ir = 0; ir < mc; ir += ker.MR)
+        {
+            ker.ker(a + (size_t)ir * kc, b + (size_t)jr * kc, c + ir * ldc + jr, ldc, kc, min(ker.MR, mc - ir),
+                    min(ker.NR, nc - jr));
+        }
+    }
+}
+
+// grow-only bump allocator for the GEMM workspaces, kept across calls; it only
+// reallocates while nothing is allocated from it, so callers reserve the whole
+// footprint up front and release back to a mark in stack order
+struct Arena
+{
+    char *base = nullptr;
+    size_t cap = 0;
+    size_t top = 0;
+
+    void reserve(size_t bytes)
+    {
+        if (bytes <= cap)
+            return;
+        if (top != 0)
+        {
+            fprintf(stderr, "arena: cannot grow while in use\n");
+            abort();
+        }
+        _mm_free(base);
+        base = (char *)_mm_malloc(bytes, 64);
+        cap = bytes;
+    }
+
+    double *alloc(size_t n)
+    {
+        size_t bytes = (n * sizeof(double) + 63) / 64 * 64;
+        if (top + bytes > cap)
+        {
+            fprintf(stderr, "arena: out of space\n");
+            abort();
+        }
+        double *p = (double *)(base + top);
+        top += bytes;
+        return p;
+    }
+
+    ~Arena()
+    {
+        _mm_free(base);
+    }
+};
+
+Arena arena;
+
+// operand placement on multi-socket nodes; shared: one packed B panel for all
+// threads, row blocks taken dynamically; local: every thread owns a fixed
+// range of C rows, which it also first-touches in main(), its packed A blocks
+// are first-touched by itself, and every NUMA node packs its own replica of
+// the B panel; threads should be bound (OMP_PROC_BIND=close) for local
+struct Placement
+{
+    bool local = false;
+    int nodes = 1;
+    vector<int> group; // node group of every thread, 0 .. nodes - 1
+    vector<int> rank;  // rank of every thread inside its group
+    vector<int> size;  // threads per group
+};
+
+Placement place;
+
+void setup_placement(bool local)
+{
+    int tn = omp_get_max_threads();
+    vector<int> node(tn, 0);
+    if (local)
+    {
+#pragma omp parallel
+        {
+            unsigned cpu = 0, nd = 0;
+            if (syscall(SYS_getcpu, &cpu, &nd, nullptr) == 0)
+                node[omp_get_thread_num()] = nd;
+        }
+    }
+    place.local = local;
+    place.group.assign(tn, 0);
+    place.rank.assign(tn, 0);
+    place.size.clear();
+    vector<int> ids;
+    for (int t = 0; t < tn; t++)
+    {
+        int g = find(ids.begin(), ids.end(), node[t]) - ids.begin();
+        if (g == (int)ids.size())
+        {
+            ids.push_back(node[t]);
+            place.size.push_back(0);
+        }
+        place.group[t] = g;
+        place.rank[t] = place.size[g]++;
+    }
+    place.nodes = ids.size();
 }
 
-void storecb(double *__restrict dst, double *__restrict src, uint64_t n)
+// row block size of mul(), shrunk so that every thread gets at least one
+int mul_mc(uint64_t n1, int MR)
 {
-    for (uint64_t i = 0; i < nb; i++)
+    int tn = omp_get_max_threads();
+    int mc = min<uint64_t>(MC, (n1 + tn - 1) / tn + MR - 1) / MR * MR;
+    return max(mc, MR);
+}
+
+// rows [r0, r1) of C owned by thread ti under the local placement
+void mul_rows(uint64_t n1, int MR, int ti, uint64_t &r0, uint64_t &r1)
+{
+    int tn = omp_get_max_threads();
+    uint64_t mc = mul_mc(n1, MR);
+    uint64_t nb = (n1 + mc - 1) / mc;
+    r0 = min(n1, nb * ti / tn * mc);
+    r1 = min(n1, nb * (ti + 1) / tn * mc);
+}
+
+// decomposition of a gemm() with fewer row blocks than threads: the mb row
+// blocks of mc rows are grouped into mg row groups, the columns cut into nb
+// chunks of nw and k into kq chunks of kw; a unit is one (row group, column
+// chunk, k chunk) triple, units of k chunk 0 add into C and those of chunk
+// q > 0 into the partial copy q - 1 of their tile
+struct Split
+{
+    uint64_t mc, nw, kw;
+    int mb, mg, nb, kq;
+};
+
+// every extra cut costs memory traffic: a row group reads B again, a column
+// chunk reads A again and a k chunk writes and reads back a copy of C; the
+// split takes the cheapest (mg, nb, kq) that gives every thread a unit, with
+// column chunks of at least 4 NR and the kq - 1 copies of C below split_bytes;
+// nothing to split when mg = nb = kq = 1
+size_t split_bytes = (size_t)256 << 20;
+
+Split mul_split(uint64_t n1, uint64_t n2, uint64_t n3, int MR, int NR)
+{
+    uint64_t tn = omp_get_max_threads();
+    Split sp;
+    sp.mc = mul_mc(n1, MR);
+    sp.mb = (n1 + sp.mc - 1) / sp.mc;
+    sp.mg = sp.nb = sp.kq = 1;
+    sp.nw = n3;
+    sp.kw = n2;
+    if (tn == 1 || (uint64_t)sp.mb >= tn || n1 * n2 * n3 == 0)
+        return sp;
+    uint64_t kb = (n2 + KC - 1) / KC;
+    uint64_t nbmax = min<uint64_t>(tn, (n3 + 4 * NR - 1) / (4 * NR));
+    uint64_t kqmax = min<uint64_t>(kb, 1 + split_bytes / (sizeof(double) * n1 * n3));
+    double best = -1;
+    uint64_t bunits = 0;
+    for (uint64_t mg = 1; mg <= (uint64_t)sp.mb; mg++)
     {
-        for (uint64_t m = 0; m < rb; m++)
+        for (uint64_t nb = 1; nb <= nbmax; nb++)
         {
-            for (uint64_t j = 0; j < nb; j++)
+            // chunks are whole NR columns and whole KC blocks, which may leave
+            // fewer chunks than asked for
+            uint64_t nw = ((n3 + nb - 1) / nb + NR - 1) / NR * NR;
+            uint64_t nbr = (n3 + nw - 1) / nw;
+            uint64_t kq = min(kqmax, (tn + mg * nbr - 1) / (mg * nbr));
+            uint64_t kbw = (kb + kq - 1) / kq;
+            kq = (kb + kbw - 1) / kbw;
+            uint64_t units = min(tn, mg * nbr * kq);
+            double cost = (double)(mg - 1) * n2 * n3 + (double)(nbr - 1) * n1 * n2 + 2.0 * (kq - 1) * n1 * n3;
+            if (units > bunits || (units == bunits && cost < best))
             {
-                moverb(dst + (i * rb + m) * n + j * rb, src + i * rb * cb + j * rb * rb + m * rb);
+                bunits = units;
+                best = cost;
+                sp.mg = mg;
+                sp.nb = nbr;
+                sp.nw = nw;
+                sp.kq = kq;
+                sp.kw = kbw * KC;
             }
         }
     }
+    return sp;
 }
 
-void mul(double *__restrict a, double *__restrict b, double *__restrict c, uint64_t n1, uint64_t n2, uint64_t n3)
+// B slice width a unit of the split path packs at a time; a unit has few row
+// blocks to reuse it for, so it is sized for L2 rather than for L3 like NC
+constexpr int NS = NC / 8;
+
+// arena bytes used by one mul() call
+size_t mul_workspace(uint64_t n1, uint64_t n2, uint64_t n3, int MR, int NR)
+{
+    if ((int)place.group.size() != omp_get_max_threads())
+        setup_placement(place.local);
+    size_t tn = omp_get_max_threads();
+    Split sp = mul_split(n1, n2, n3, MR, NR);
+    if (sp.mg * sp.nb * sp.kq > 1)
+        return sizeof(double) * (n1 * n3 * (sp.kq - 1) + (size_t)KC * min<uint64_t>(NS, sp.nw) * tn +
+                                 (size_t)MC * KC * tn) +
+               64 * 3;
+    return sizeof(double) * ((size_t)KC * NC * place.nodes + (size_t)MC * KC * tn) + 64 * (place.nodes + 1);
+}
+
+// units [head, tail) still owned by one thread of the split path, packed into
+// one word (head in the low half) so that a single CAS moves either end
+struct alignas(64) StealRange
+{
+    std::atomic<uint64_t> w;
+};
+
+// the owner takes the unit at the head
+inline bool take_head(std::atomic<uint64_t> &w, uint32_t &u)
+{
+    uint64_t v = w.load(std::memory_order_relaxed);
+    while ((uint32_t)v < (uint32_t)(v >> 32))
+    {
+        if (w.compare_exchange_weak(v, v + 1, std::memory_order_relaxed))
+        {
+            u = (uint32_t)v;
+            return true;
+        }
+    }
+    return false;
+}
+
+// a thief takes the unit at the tail
+inline bool take_tail(std::atomic<uint64_t> &w, uint32_t &u)
 {
+    uint64_t v = w.load(std::memory_order_relaxed);
+    while ((uint32_t)v < (uint32_t)(v >> 32))
+    {
+        if (w.compare_exchange_weak(v, v - ((uint64_t)1 << 32), std::memory_order_relaxed))
+        {
+            u = (uint32_t)(v >> 32) - 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+// split path of gemm(): every thread starts with a contiguous range of the
+// units of sp, works through it from the head and, once it runs dry, steals
+// units from the tails of the other ranges; a unit packs its own slices of B
+// and row blocks of A, and the partial copies are then summed into c over rows and
+// column chunks at once, so that all threads share the reduction
+template <typename T>
+void gemm_split(const KernelT<T> &ker, const double *__restrict a, uint64_t lda, const double *__restrict b,
+                uint64_t ldb, double *__restrict c, uint64_t ldc, uint64_t n1, uint64_t n2, uint64_t n3,
+                const Split &sp)
+{
+    int NR = ker.NR;
+    int KP = ker.KP;
     int tn = omp_get_max_threads();
-    double *ws = (double *)_mm_malloc(cb * cb * 8 * 3 * tn, 64);
+    uint64_t bw = min<uint64_t>(NS, sp.nw);
+    double *part = arena.alloc(n1 * n3 * (sp.kq - 1));
+    T *bps = (T *)arena.alloc((size_t)KC * bw * tn);
+    T *ap = (T *)arena.alloc((size_t)MC * KC * tn);
+    uint64_t nu = (uint64_t)sp.mg * sp.nb * sp.kq;
+    vector<StealRange> ranges(tn);
+    for (int t = 0; t < tn; t++)
+    {
+        uint64_t u0 = nu * t / tn;
+        uint64_t u1 = nu * (t + 1) / tn;
+        ranges[t].w.store(u0 | u1 << 32, std::memory_order_relaxed);
+    }
 
 #pragma omp parallel
     {
-        int n = n1 / cb * n3 / cb;
         int ti = omp_get_thread_num();
-        size_t is = n * ti / tn;
-        size_t ie = n * (ti + 1) / tn;
+        T *bp = bps + (size_t)KC * bw * ti;
+        T *ap_ = ap + (size_t)MC * KC * ti;
+        uint32_t u;
+        for (;;)
+        {
+            bool got = take_head(ranges[ti].w, u);
+            for (int v = 1; v < tn && !got; v++)
+                got = take_tail(ranges[(ti + v) % tn].w, u);
+            if (!got)
+                break;
+            int q = u % sp.kq;
+            int t = u / sp.kq;
+            int g = t / sp.nb;
+            uint64_t i0 = (uint64_t)sp.mb * g / sp.mg * sp.mc;
+            uint64_t i1 = min(n1, (uint64_t)sp.mb * (g + 1) / sp.mg * sp.mc);
+            uint64_t j0 = t % sp.nb * sp.nw;
+            uint64_t k0 = q * sp.kw;
+            uint64_t j1 = min(n3, j0 + sp.nw);
+            uint64_t k1 = min(n2, k0 + sp.kw);
+            double *cq = q == 0 ? c : part + n1 * n3 * (q - 1);
+            uint64_t ldq = q == 0 ? ldc : n3;
+            if (q > 0)
+            {
+                for (uint64_t i = i0; i < i1; i++)
+                    fill(cq + i * ldq + j0, cq + i * ldq + j1, 0.0);
+            }
+            for (uint64_t jc = j0; jc < j1; jc += bw)
+            {
+                int nc = min<uint64_t>(bw, j1 - jc);
+                for (uint64_t pc = k0; pc < k1; pc += KC)
+                {
+                    int kc = min<uint64_t>(KC, k1 - pc);
+                    int kcp = (kc + KP - 1) / KP * KP;
+                    for (int jr = 0; jr < nc; jr += NR)
+                    {
+                        ker.packb(bp + (size_t)jr * kcp, b + pc * ldb + jc + jr, ldb, kc, min(NR, nc - jr));
+                    }
+                    for (uint64_t ic = i0; ic < i1; ic += sp.mc)
+                    {
+                        int mc_ = min<uint64_t>(sp.mc, i1 - ic);
+                        ker.packa(ap_, a + ic * lda + pc, lda, mc_, kc);
+                        mulcb(ker, ap_, bp, cq + ic * ldq + jc, ldq, mc_, nc, kcp);
+                    }
+                }
+            }
+        }
+        if (sp.kq > 1)
+        {
+            constexpr uint64_t rw = 512;
+            uint64_t nr = (n3 + rw - 1) / rw;
+#pragma omp barrier
+#pragma omp for collapse(2) schedule(static)
+            for (uint64_t i = 0; i < n1; i++)
+            {
+                for (uint64_t jb = 0; jb < nr; jb++)
+                {
+                    uint64_t j1 = min(n3, jb * rw + rw);
+                    for (int q = 1; q < sp.kq; q++)
+                    {
+                        const double *p = part + n1 * n3 * (q - 1) + i * n3;
+#pragma omp simd
+                        for (uint64_t j = jb * rw; j < j1; j++)
+                        {
+                            c[i * ldc + j] += p[j];
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// c += a * b for any n1 x n2 x n3 with row strides lda, ldb, ldc, through the
+// kernel ker (and its packing, which sets the operand precision); the B panel
+// is packed once per (jc, pc) step by all threads (once per node group under
+// the local placement), then every thread packs and multiplies its own MC row
+// blocks of A against it; too few row blocks for the threads take the split path
+template <typename T>
+void gemm(const KernelT<T> &ker, const double *__restrict a, uint64_t lda, const double *__restrict b, uint64_t ldb,
+          double *__restrict c, uint64_t ldc, uint64_t n1, uint64_t n2, uint64_t n3)
+{
+    int MR = ker.MR;
+    int NR = ker.NR;
+    int KP = ker.KP;
+    int tn = omp_get_max_threads();
+    int mc = mul_mc(n1, MR);
+    size_t mark = arena.top;
+    arena.reserve(arena.top + mul_workspace(n1, n2, n3, MR, NR));
+    Split sp = mul_split(n1, n2, n3, MR, NR);
+    if (sp.mg * sp.nb * sp.kq > 1)
+    {
+        gemm_split(ker, a, lda, b, ldb, c, ldc, n1, n2, n3, sp);
+        arena.top = mark;
+        return;
+    }
+    vector<T *> bps(place.nodes);
+    for (int g = 0; g < place.nodes; g++)
+        bps[g] = (T *)arena.alloc((size_t)KC * NC);
+    T *ap = (T *)arena.alloc((size_t)MC * KC * tn);
+
+#pragma omp parallel
+    {
+        int ti = omp_get_thread_num();
+        T *ap_ = ap + (size_t)MC * KC * ti;
+        T *bp = bps[place.group[ti]];
+        int gr = place.rank[ti];
+        int gs = place.size[place.group[ti]];
+        uint64_t r0, r1;
+        mul_rows(n1, MR, ti, r0, r1);
+        for (uint64_t jc = 0; jc < n3; jc += NC)
+        {
+            int nc = min<uint64_t>(NC, n3 - jc);
+            for (uint64_t pc = 0; pc < n2; pc += KC)
+            {
+                int kc = min<uint64_t>(KC, n2 - pc);
+                int kcp = (kc + KP - 1) / KP * KP;
+                if (!place.local)
+                {
+#pragma omp for schedule(static)
+                    for (int jr = 0; jr < nc; jr += NR)
+                    {
+                        ker.packb(bp + (size_t)jr * kcp, b + pc * ldb + jc + jr, ldb, kc, min(NR, nc - jr));
+                    }
+#pragma omp for schedule(dynamic)
+                    for (uint64_t ic = 0; ic < n1; ic += mc)
+                    {
+                        int mc_ = min<uint64_t>(mc, n1 - ic);
+                        ker.packa(ap_, a + ic * lda + pc, lda, mc_, kc);
+                        mulcb(ker, ap_, bp, c + ic * ldc + jc, ldc, mc_, nc, kcp);
+                    }
+                    continue;
+                }
+                for (int jr = gr * NR; jr < nc; jr += gs * NR)
+                {
+                    ker.packb(bp + (size_t)jr * kcp, b + pc * ldb + jc + jr, ldb, kc, min(NR, nc - jr));
+                }
+#pragma omp barrier
+                for (uint64_t ic = r0; ic < r1; ic += mc)
+                {
+                    int mc_ = min<uint64_t>(mc, r1 - ic);
+                    ker.packa(ap_, a + ic * lda + pc, lda, mc_, kc);
+                    mulcb(ker, ap_, bp, c + ic * ldc + jc, ldc, mc_, nc, kcp);
+                }
+#pragma omp barrier
+            }
+        }
+    }
+    arena.top = mark;
+}
+
+void mul(const double *__restrict a, uint64_t lda, const double *__restrict b, uint64_t ldb, double *__restrict c,
+         uint64_t ldc, uint64_t n1, uint64_t n2, uint64_t n3)
+{
+    gemm(kernel, a, lda, b, ldb, c, ldc, n1, n2, n3);
+}
+
+void mul(double *__restrict a, double *__restrict b, double *__restrict c, uint64_t n1, uint64_t n2, uint64_t n3)
+{
+    mul(a, n2, b, n3, c, n3, n1, n2, n3);
+}
 
-        double *ws_ = ws + cb * cb * 3 * ti;
-        double *a_l, *b_l, *c_l;
-        a_l = ws_;
-        b_l = ws_ + cb * cb;
-        c_l = ws_ + 2 * cb * cb;
+// c += a * b in the given precision
+void mul(Precision prec, double *a, double *b, double *c, uint64_t n1, uint64_t n2, uint64_t n3)
+{
+    if (prec == Precision::FP32)
+        gemm(kernel32, a, n2, b, n3, c, n3, n1, n2, n3);
+    else if (prec == Precision::BF16 && has_bf16)
+        gemm(kernelbf16, a, n2, b, n3, c, n3, n1, n2, n3);
+    else if (prec == Precision::BF16)
+        gemm(kernel16, a, n2, b, n3, c, n3, n1, n2, n3);
+    else
+        mul(a, b, c, n1, n2, n3);
+}
+
+// name and MR of the kernel mul(prec, ...) runs
+const char *precision_kernel(Precision prec, int &MR)
+{
+    if (prec == Precision::FP32)
+    {
+        MR = kernel32.MR;
+        return kernel32.name;
+    }
+    if (prec == Precision::BF16 && has_bf16)
+    {
+        MR = kernelbf16.MR;
+        return kernelbf16.name;
+    }
+    if (prec == Precision::BF16)
+    {
+        MR = kernel16.MR;
+        return kernel16.name;
+    }
+    MR = kernel.MR;
+    return kernel.name;
+}
 
-        for (uint64_t it = is; it < ie; it++)
+// d = x + s * y over rows x cols, all row-major with their own strides
+void addm(double *d, uint64_t ldd, const double *x, uint64_t ldx, const double *y, uint64_t ldy, uint64_t rows,
+          uint64_t cols, double s)
+{
+#pragma omp parallel for schedule(static)
+    for (uint64_t i = 0; i < rows; i++)
+    {
+        for (uint64_t j = 0; j < cols; j++)
         {
-            uint64_t i = it / (n3 / cb) * cb;
-            uint64_t k = it % (n3 / cb) * cb;
+            d[i * ldd + j] = x[i * ldx + j] + s * y[i * ldy + j];
+        }
+    }
+}
+
+// Strassen-Winograd: 7 half-size products and 15 additions per level instead
+// of 8 products, applied while all of n1, n2, n3 are even and at least
+// threshold, down to levels deep; the leaves run mul(). The error bound is
+// norm-wise rather than element-wise and grows by a small constant factor per
+// level (errors a few times to ~10x the classical product per level on random
+// data), so use it where the inputs are well scaled
+int strassen_levels = 0;
+uint64_t strassen_threshold = 2048;
 
-            double *__restrict c_ = c + i * n3 + k;
-            loadcb(c_l, c_, n3);
-            for (uint64_t j = 0; j < n2; j += cb)
+inline bool strassen_split(uint64_t n1, uint64_t n2, uint64_t n3, int level)
+{
+    return level > 0 && n1 % 2 == 0 && n2 % 2 == 0 && n3 % 2 == 0 &&
+           min(n1, min(n2, n3)) >= strassen_threshold;
+}
+
+// arena bytes used by strassen() below one call
+size_t strassen_workspace(uint64_t n1, uint64_t n2, uint64_t n3, int level)
+{
+    if (!strassen_split(n1, n2, n3, level))
+        return mul_workspace(n1, n2, n3, kernel.MR, kernel.NR);
+    uint64_t h1 = n1 / 2, h2 = n2 / 2, h3 = n3 / 2;
+    return sizeof(double) * (h1 * h3 + h1 * h2 + h2 * h3) + 192 + strassen_workspace(h1, h2, h3, level - 1);
+}
+
+// c = a * b (overwrites c)
+void strassen(const double *a, uint64_t lda, const double *b, uint64_t ldb, double *c, uint64_t ldc, uint64_t n1,
+              uint64_t n2, uint64_t n3, int level)
+{
+    if (!strassen_split(n1, n2, n3, level))
+    {
+#pragma omp parallel for schedule(static)
+        for (uint64_t i = 0; i < n1; i++)
+        {
+            fill(c + i * ldc, c + i * ldc + n3, 0.0);
+        }
+        mul(a, lda, b, ldb, c, ldc, n1, n2, n3);
+        return;
+    }
+    uint64_t h1 = n1 / 2, h2 = n2 / 2, h3 = n3 / 2;
+    const double *a11 = a, *a12 = a + h2, *a21 = a + h1 * lda, *a22 = a21 + h2;
+    const double *b11 = b, *b12 = b + h3, *b21 = b + h2 * ldb, *b22 = b21 + h3;
+    double *c11 = c, *c12 = c + h3, *c21 = c + h1 * ldc, *c22 = c21 + h3;
+
+    size_t mark = arena.top;
+    double *x = arena.alloc(h1 * h3);
+    double *sa = arena.alloc(h1 * h2);
+    double *tb = arena.alloc(h2 * h3);
+
+    // P1 = A11 B11, C11 = P1 + P2
+    strassen(a11, lda, b11, ldb, x, h3, h1, h2, h3, level - 1);
+    strassen(a12, lda, b21, ldb, c11, ldc, h1, h2, h3, level - 1);
+    addm(c11, ldc, c11, ldc, x, h3, h1, h3, 1.0);
+    // P7 = (A11 - A21)(B22 - B12) in C22
+    addm(sa, h2, a11, lda, a21, lda, h1, h2, -1.0);
+    addm(tb, h3, b22, ldb, b12, ldb, h2, h3, -1.0);
+    strassen(sa, h2, tb, h3, c22, ldc, h1, h2, h3, level - 1);
+    // P5 = S1 T1 in C12, S1 = A21 + A22, T1 = B12 - B11
+    addm(sa, h2, a21, lda, a22, lda, h1, h2, 1.0);
+    addm(tb, h3, b12, ldb, b11, ldb, h2, h3, -1.0);
+    strassen(sa, h2, tb, h3, c12, ldc, h1, h2, h3, level - 1);
+    // P6 = S2 T2 in C21, S2 = S1 - A11, T2 = B22 - T1
+    addm(sa, h2, sa, h2, a11, lda, h1, h2, -1.0);
+    addm(tb, h3, b22, ldb, tb, h3, h2, h3, -1.0);
+    strassen(sa, h2, tb, h3, c21, ldc, h1, h2, h3, level - 1);
+    // U2 = P1 + P6, U3 = U2 + P7, C22 = U3 + P5, U4 = U2 + P5
+    addm(x, h3, x, h3, c21, ldc, h1, h3, 1.0);
+    addm(c21, ldc, x, h3, c22, ldc, h1, h3, 1.0);
+    addm(c22, ldc, c21, ldc, c12, ldc, h1, h3, 1.0);
+    addm(c12, ldc, c12, ldc, x, h3, h1, h3, 1.0);
+    // C12 = U4 + P3, P3 = S4 B22, S4 = A12 - S2
+    addm(sa, h2, a12, lda, sa, h2, h1, h2, -1.0);
+    strassen(sa, h2, b22, ldb, x, h3, h1, h2, h3, level - 1);
+    addm(c12, ldc, c12, ldc, x, h3, h1, h3, 1.0);
+    // C21 = U3 - P4, P4 = A22 T4, T4 = T2 - B21
+    addm(tb, h3, tb, h3, b21, ldb, h2, h3, -1.0);
+    strassen(a22, lda, tb, h3, x, h3, h1, h2, h3, level - 1);
+    addm(c21, ldc, c21, ldc, x, h3, h1, h3, -1.0);
+
+    arena.top = mark;
+}
+
+void strassen(double *a, double *b, double *c, uint64_t n1, uint64_t n2, uint64_t n3)
+{
+    arena.reserve(strassen_workspace(n1, n2, n3, strassen_levels));
+    strassen(a, n2, b, n3, c, n3, n1, n2, n3, strassen_levels);
+}
+
+// batched small products: every dimension falls in a shape class of 8, 16,
+// 32 or 64 and each class triple has its own fully sized kernel, so all loop
+// trip counts are compile-time constants; products whose dimensions are not
+// exactly the class sizes go through zero padded per-thread buffers
+constexpr int small_max = 64;
+
+template <int M, int K, int N>
+void smallmul_generic(const double *__restrict a, const double *__restrict b, double *__restrict c)
+{
+    for (int i = 0; i < M; i++)
+    {
+        double cr[N];
+        for (int j = 0; j < N; j++)
+        {
+            cr[j] = c[i * N + j];
+        }
+        for (int k = 0; k < K; k++)
+        {
+            double ar = a[i * K + k];
+            for (int j = 0; j < N; j++)
             {
+                cr[j] += ar * b[k * N + j];
+            }
+        }
+        for (int j = 0; j < N; j++)
+        {
+            c[i * N + j] = cr[j];
+        }
+    }
+}
 
-                double *__restrict a_ = a + i * n2 + j;
-                double *__restrict b_ = b + j * n3 + k;
+using SmallKernel = void (*)(const double *__restrict a, const double *__restrict b, double *__restrict c);
 
-                loadcb(a_l, a_, n2);
-                loadcb(b_l, b_, n3);
+// RB rows of C at a time in RB x N / 8 zmm accumulators, at most 16 of them
+template <int M, int K, int N>
+__attribute__((target("avx512f"))) void smallmul_avx512(const double *__restrict a, const double *__restrict b,
+                                                        double *__restrict c)
+{
+    constexpr int NV = N / 8;
+    constexpr int RB = M < 16 / NV ? M : 16 / NV;
+    for (int i = 0; i < M; i += RB)
+    {
+        __m512d cr[RB][NV];
+        for (int r = 0; r < RB; r++)
+        {
+            for (int v = 0; v < NV; v++)
+            {
+                cr[r][v] = _mm512_loadu_pd(c + (i + r) * N + v * 8);
+            }
+        }
+        for (int k = 0; k < K; k++)
+        {
+            __m512d br[NV];
+            for (int v = 0; v < NV; v++)
+            {
+                br[v] = _mm512_loadu_pd(b + k * N + v * 8);
+            }
+            for (int r = 0; r < RB; r++)
+            {
+                __m512d ar = _mm512_set1_pd(a[(i + r) * K + k]);
+                for (int v = 0; v < NV; v++)
+                {
+                    cr[r][v] = _mm512_fmadd_pd(ar, br[v], cr[r][v]);
+                }
+            }
+        }
+        for (int r = 0; r < RB; r++)
+        {
+            for (int v = 0; v < NV; v++)
+            {
+                _mm512_storeu_pd(c + (i + r) * N + v * 8, cr[r][v]);
+            }
+        }
+    }
+}
+
+inline int small_class(uint64_t n)
+{
+    return n <= 8 ? 0 : n <= 16 ? 1 : n <= 32 ? 2 : 3;
+}
 
-                mulcb(a_l, b_l, c_l);
+template <int M, int K>
+SmallKernel small_pick(int c3, bool avx512)
+{
+    switch (c3)
+    {
+    case 0:
+        return avx512 ? smallmul_avx512<M, K, 8> : smallmul_generic<M, K, 8>;
+    case 1:
+        return avx512 ? smallmul_avx512<M, K, 16> : smallmul_generic<M, K, 16>;
+    case 2:
+        return avx512 ? smallmul_avx512<M, K, 32> : smallmul_generic<M, K, 32>;
+    default:
+        return avx512 ? smallmul_avx512<M, K, 64> : smallmul_generic<M, K, 64>;
+    }
+}
+
+template <int M>
+SmallKernel small_pick(int c2, int c3, bool avx512)
+{
+    switch (c2)
+    {
+    case 0:
+        return small_pick<M, 8>(c3, avx512);
+    case 1:
+        return small_pick<M, 16>(c3, avx512);
+    case 2:
+        return small_pick<M, 32>(c3, avx512);
+    default:
+        return small_pick<M, 64>(c3, avx512);
+    }
+}
+
+SmallKernel small_pick(int c1, int c2, int c3, bool avx512)
+{
+    switch (c1)
+    {
+    case 0:
+        return small_pick<8>(c2, c3, avx512);
+    case 1:
+        return small_pick<16>(c2, c3, avx512);
+    case 2:
+        return small_pick<32>(c2, c3, avx512);
+    default:
+        return small_pick<64>(c2, c3, avx512);
+    }
+}
+
+// per-thread padding buffers for A, B and C, allocated with the thread
+alignas(64) thread_local double small_ws[3][small_max * small_max];
+
+// c[i] += a[i] * b[i] for i < count, the products are stored back to back:
+// a[i] is n1 x n2 at a + i * n1 * n2 and so on; shapes past 64 fall back to
+// one mul() per product
+void mul_batched(const double *a, const double *b, double *c, uint64_t n1, uint64_t n2, uint64_t n3,
+                 uint64_t count)
+{
+    uint64_t sa = n1 * n2, sb = n2 * n3, sc = n1 * n3;
+    if (max(n1, max(n2, n3)) > small_max)
+    {
+        for (uint64_t i = 0; i < count; i++)
+        {
+            mul(a + i * sa, n2, b + i * sb, n3, c + i * sc, n3, n1, n2, n3);
+        }
+        return;
+    }
+    int m = 8 << small_class(n1), k = 8 << small_class(n2), n = 8 << small_class(n3);
+    SmallKernel ker = small_pick(small_class(n1), small_class(n2), small_class(n3),
+                                 strcmp(kernel.name, "avx512") == 0);
+    bool exact = (int)n1 == m && (int)n2 == k && (int)n3 == n;
+
+#pragma omp parallel
+    {
+        double *pa = small_ws[0], *pb = small_ws[1], *pc = small_ws[2];
+        if (!exact)
+        {
+            fill(pa, pa + m * k, 0.0);
+            fill(pb, pb + k * n, 0.0);
+        }
+#pragma omp for schedule(static)
+        for (uint64_t i = 0; i < count; i++)
+        {
+            if (exact)
+            {
+                ker(a + i * sa, b + i * sb, c + i * sc);
+                continue;
+            }
+            for (uint64_t r = 0; r < n1; r++)
+            {
+                copy(a + i * sa + r * n2, a + i * sa + (r + 1) * n2, pa + r * k);
+                copy(c + i * sc + r * n3, c + i * sc + (r + 1) * n3, pc + r * n);
+            }
+            for (uint64_t r = 0; r < n2; r++)
+            {
+                copy(b + i * sb + r * n3, b + i * sb + (r + 1) * n3, pb + r * n);
+            }
+            ker(pa, pb, pc);
+            for (uint64_t r = 0; r < n1; r++)
+            {
+                copy(pc + r * n, pc + r * n + n3, c + i * sc + r * n3);
             }
-            storecb(c_, c_l, n3);
         }
     }
 }
 
-int main()
+// bench.cpp includes this file with MUL_NO_MAIN for the kernels alone
+#ifndef MUL_NO_MAIN
+int main(int argc, char *argv[])
 {
+    // -s levels: Strassen-Winograd recursion depth, -t n: smallest dimension
+    // that is still split, -p shared|local: operand placement, -f
+    // fp64|fp32|bf16: input precision (fp32 and bf16 skip Strassen)
+    bool local = false;
+    Precision prec = Precision::FP64;
+    for (int i = 1; i + 1 < argc; i++)
+    {
+        if (strcmp(argv[i], "-s") == 0)
+            strassen_levels = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-t") == 0)
+            strassen_threshold = strtoull(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "-p") == 0)
+            local = strcmp(argv[++i], "local") == 0;
+        else if (strcmp(argv[i], "-f") == 0)
+        {
+            i++;
+            if (strcmp(argv[i], "fp32") == 0)
+                prec = Precision::FP32;
+            else if (strcmp(argv[i], "bf16") == 0)
+                prec = Precision::BF16;
+        }
+    }
+    setup_placement(local);
+
     auto t1 = std::chrono::steady_clock::now();
 
     size_t n1, n2, n3;
@@ -173,56 +1242,57 @@ int main()
     n2 = *(size_t *)(addr + 8);
     n3 = *(size_t *)(addr + 16);
     printf("%d,%d,%d\n", n1, n2, n3);
+    int MR;
+    const char *kname = precision_kernel(prec, MR);
+    const char *pname[] = {"fp64", "fp32", "bf16"};
+    printf("kernel: %s, %s\n", kname, pname[(int)prec]);
+
+    // the packing stage reads A and B straight from the mapping and the
+    // micro-kernels write C straight into the mapping of out.data, so neither
+    // side is staged through a private copy
+    double *a = (double *)(addr + 24);
+    double *b = (double *)(addr + 24 + n1 * n2 * 8);
 
-    double *a = (double *)_mm_malloc(n1 * n2 * 8, 64);
-    double *b = (double *)_mm_malloc(n2 * n3 * 8, 64);
-    double *c = (double *)_mm_malloc(n1 * n3 * 8, 64);
+    int fo = open("out.data", O_RDWR | O_CREAT, 00644);
+    ftruncate(fo, n1 * n3 * 8);
+    char *oaddr = (char *)mmap(NULL, n1 * n3 * 8, PROT_READ | PROT_WRITE, MAP_SHARED, fo, 0);
+    double *c = (double *)oaddr;
     printf("%x,%x,%x\n", a, b, c);
 
-#pragma omp parallel for
-    for (int64_t i = 0; i < n1 * n2; i++)
-    {
-        a[i] = ((double *)(addr + 24))[i];
-    }
+    auto t2 = std::chrono::steady_clock::now();
 
-#pragma omp parallel for
-    for (int64_t i = 0; i < n2 * n3; i++)
+    // also faults the output pages in, in parallel; under the local placement
+    // every thread touches the rows of C it computes later
+    if (place.local)
     {
-        b[i] = ((double *)(addr + 24 + n1 * n2 * 8))[i];
+#pragma omp parallel
+        {
+            uint64_t r0, r1;
+            mul_rows(n1, MR, omp_get_thread_num(), r0, r1);
+            fill(c + r0 * n3, c + r1 * n3, 0.0);
+        }
     }
-    munmap(addr, len);
-    close(fd);
-
-    // fread(a, 1, n1 * n2 * 8, fi);
-    // fread(b, 1, n2 * n3 * 8, fi);
-    // fclose(fi);
-
-    auto t2 = std::chrono::steady_clock::now();
-
-#pragma omp parallel for
-    for (uint64_t i = 0; i < n1 * n3; i++)
+    else
     {
-        c[i] = 0;
+#pragma omp parallel for
+        for (uint64_t i = 0; i < n1 * n3; i++)
+        {
+            c[i] = 0;
+        }
     }
 
     auto t3 = std::chrono::steady_clock::now();
-    mul(a, b, c, n1, n2, n3);
+    if (prec != Precision::FP64)
+        mul(prec, a, b, c, n1, n2, n3);
+    else if (strassen_levels > 0)
+        strassen(a, b, c, n1, n2, n3);
+    else
+        mul(a, b, c, n1, n2, n3);
     auto t4 = std::chrono::steady_clock::now();
 
-    // fi = fopen("out.data", "wb");
-    // fwrite(c, 1, n1 * n3 * 8, fi);
-    // fclose(fi);
-
-    fd = open("out.data", O_RDWR | O_CREAT, 00644);
-    ftruncate(fd, n1 * n3 * 8);
-    addr = (char *)mmap(NULL, n1 * n3 * 8, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    // printf("%d,%x\n",fd,addr);
-#pragma omp parallel for
-    for (uint64_t i = 0; i < n1 * n3; i++)
-    {
-        ((double *)(addr))[i] = c[i];
-    }
-    munmap(addr, n1 * n3 * 8);
+    munmap(oaddr, n1 * n3 * 8);
+    close(fo);
+    munmap(addr, len);
     close(fd);
 
     auto t5 = std::chrono::steady_clock::now();
@@ -231,7 +1301,9 @@ int main()
     int d2 = std::chrono::duration_cast<std::chrono::milliseconds>(t3 - t2).count();
     int d3 = std::chrono::duration_cast<std::chrono::milliseconds>(t4 - t3).count();
     int d4 = std::chrono::duration_cast<std::chrono::milliseconds>(t5 - t4).count();
+    printf("placement: %s, %d node(s)\n", place.local ? "local" : "shared", place.nodes);
     printf("%d,%d,%d,%d\n", d1, d2, d3, d4);
 
     return 0;
 }
+#endif
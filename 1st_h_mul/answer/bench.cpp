@@ -0,0 +1,520 @@
+// GEMM benchmark and roofline harness over the kernels of answer.cpp
+//
+//   g++ -O3 -fopenmp -mavx512f bench.cpp -o bench
+//   ./bench [-s shapes] [-t threads] [-k paths] [-r reps] [-m MiB] [-c]
+//           [-g baseline.csv] [-d tol]
+//
+// -s: comma separated n1xn2xn3 (or n for a cube), -t: comma separated thread
+// counts, -k: comma separated paths (fp64/avx512, fp64/avx2, fp64/scalar,
+// fp32, bf16), all supported ones by default, -r: timed repetitions after one
+// warm-up, -m: array size of the bandwidth probe, -c: read perf_event counters
+// around the timed multiplies (packing included), -g: fail (exit 1) when the
+// median GFLOP/s of a configuration also listed in the baseline, a previous
+// output of this program, is more than tol (default 0.1) below it
+//
+// peak is the FMA (or dot product) throughput of the path's own instructions
+// (of whatever the compiler makes of a plain loop for the portable kernels),
+// measured with all threads on register-only loops, bw the triad bandwidth;
+// roof = min(peak, ai * bw) with ai = 2 n1 n2 n3 / (8 (n1 n2 + n2 n3 + 2 n1 n3))
+// bytes of compulsory traffic, the bound of a perfect cache
+#define MUL_NO_MAIN
+#include "answer.cpp"
+
+#include <cmath>
+#include <linux/perf_event.h>
+#include <map>
+#include <string>
+#include <sys/ioctl.h>
+
+using std::map;
+using std::string;
+
+struct Shape
+{
+    uint64_t n1, n2, n3;
+};
+
+// one multiply path: precision and kernel
+struct Path
+{
+    const char *name;
+    bool ok;
+    void (*run)(const double *a, const double *b, double *c, uint64_t n1, uint64_t n2, uint64_t n3);
+    double (*probe)(long iters); // flops done by one thread
+};
+
+__attribute__((target("avx512f"))) double probe_avx512_fp64(long iters)
+{
+    __m512d x[16];
+    __m512d y = _mm512_set1_pd(0.9999999);
+    __m512d z = _mm512_set1_pd(1e-7);
+    for (int j = 0; j < 16; j++)
+        x[j] = _mm512_set1_pd(j);
+    for (long i = 0; i < iters; i++)
+    {
+        for (int j = 0; j < 16; j++)
+            x[j] = _mm512_fmadd_pd(x[j], y, z);
+    }
+    for (int j = 1; j < 16; j++)
+        x[0] = _mm512_add_pd(x[0], x[j]);
+    volatile double sink = _mm512_reduce_add_pd(x[0]);
+    (void)sink;
+    return 2.0 * 8 * 16 * iters;
+}
+
+__attribute__((target("avx2,fma"))) double probe_avx2_fp64(long iters)
+{
+    __m256d x[12];
+    __m256d y = _mm256_set1_pd(0.9999999);
+    __m256d z = _mm256_set1_pd(1e-7);
+    for (int j = 0; j < 12; j++)
+        x[j] = _mm256_set1_pd(j);
+    for (long i = 0; i < iters; i++)
+    {
+        for (int j = 0; j < 12; j++)
+            x[j] = _mm256_fmadd_pd(x[j], y, z);
+    }
+    for (int j = 1; j < 12; j++)
+        x[0] = _mm256_add_pd(x[0], x[j]);
+    volatile double sink = x[0][0] + x[0][1] + x[0][2] + x[0][3];
+    (void)sink;
+    return 2.0 * 4 * 12 * iters;
+}
+
+// the portable kernels are vectorized as far as the compile flags allow, so
+// is their probe
+template <typename T>
+double probe_portable(long iters)
+{
+    T x[64];
+    for (int j = 0; j < 64; j++)
+        x[j] = j;
+    for (long i = 0; i < iters; i++)
+    {
+        for (int j = 0; j < 64; j++)
+            x[j] = x[j] * (T)0.9999999 + (T)1e-7;
+    }
+    T s = 0;
+    for (int j = 0; j < 64; j++)
+        s += x[j];
+    volatile T sink = s;
+    (void)sink;
+    return 2.0 * 64 * iters;
+}
+
+__attribute__((target("avx512f"))) double probe_avx512_fp32(long iters)
+{
+    __m512 x[16];
+    __m512 y = _mm512_set1_ps(0.9999999f);
+    __m512 z = _mm512_set1_ps(1e-7f);
+    for (int j = 0; j < 16; j++)
+        x[j] = _mm512_set1_ps(j);
+    for (long i = 0; i < iters; i++)
+    {
+        for (int j = 0; j < 16; j++)
+            x[j] = _mm512_fmadd_ps(x[j], y, z);
+    }
+    for (int j = 1; j < 16; j++)
+        x[0] = _mm512_add_ps(x[0], x[j]);
+    volatile float sink = _mm512_reduce_add_ps(x[0]);
+    (void)sink;
+    return 2.0 * 16 * 16 * iters;
+}
+
+__attribute__((target("avx512f,avx512bf16"))) double probe_avx512_bf16(long iters)
+{
+    __m512 x[16];
+    __m512bh y = (__m512bh)_mm512_set1_epi16(0x3f80);
+    __m512bh z = (__m512bh)_mm512_set1_epi16(0x3380);
+    for (int j = 0; j < 16; j++)
+        x[j] = _mm512_set1_ps(j);
+    for (long i = 0; i < iters; i++)
+    {
+        for (int j = 0; j < 16; j++)
+            x[j] = _mm512_dpbf16_ps(x[j], y, z);
+    }
+    for (int j = 1; j < 16; j++)
+        x[0] = _mm512_add_ps(x[0], x[j]);
+    volatile float sink = _mm512_reduce_add_ps(x[0]);
+    (void)sink;
+    return 4.0 * 16 * 16 * iters;
+}
+
+const Path paths[] = {
+    {"fp64/avx512", kernel_ok(0),
+     [](const double *a, const double *b, double *c, uint64_t n1, uint64_t n2, uint64_t n3) {
+         gemm(kernels[0], a, n2, b, n3, c, n3, n1, n2, n3);
+     },
+     probe_avx512_fp64},
+    {"fp64/avx2", kernel_ok(1),
+     [](const double *a, const double *b, double *c, uint64_t n1, uint64_t n2, uint64_t n3) {
+         gemm(kernels[1], a, n2, b, n3, c, n3, n1, n2, n3);
+     },
+     probe_avx2_fp64},
+    {"fp64/scalar", kernel_ok(2),
+     [](const double *a, const double *b, double *c, uint64_t n1, uint64_t n2, uint64_t n3) {
+         gemm(kernels[2], a, n2, b, n3, c, n3, n1, n2, n3);
+     },
+     probe_portable<double>},
+    {"fp32", true,
+     [](const double *a, const double *b, double *c, uint64_t n1, uint64_t n2, uint64_t n3) {
+         gemm(kernel32, a, n2, b, n3, c, n3, n1, n2, n3);
+     },
+     &kernel32 == &kernels32[0] ? probe_avx512_fp32 : probe_portable<float>},
+    {"bf16", true,
+     [](const double *a, const double *b, double *c, uint64_t n1, uint64_t n2, uint64_t n3) {
+         if (has_bf16)
+             gemm(kernelbf16, a, n2, b, n3, c, n3, n1, n2, n3);
+         else
+             gemm(kernel16, a, n2, b, n3, c, n3, n1, n2, n3);
+     },
+     has_bf16 ? probe_avx512_bf16 : &kernel16 == &kernels16[0] ? probe_avx512_fp32 : probe_portable<float>},
+};
+
+double seconds(std::chrono::steady_clock::time_point t0, std::chrono::steady_clock::time_point t1)
+{
+    return std::chrono::duration<double>(t1 - t0).count();
+}
+
+// GFLOP/s of probe on tn threads, best of three
+double measure_peak(double (*probe)(long), int tn)
+{
+    const long iters = 4 << 20;
+    double best = 0.0;
+    for (int r = 0; r < 3; r++)
+    {
+        double flops = 0.0;
+        auto t0 = std::chrono::steady_clock::now();
+#pragma omp parallel num_threads(tn) reduction(+ : flops)
+        flops += probe(iters);
+        auto t1 = std::chrono::steady_clock::now();
+        best = max(best, flops / seconds(t0, t1) * 1e-9);
+    }
+    return best;
+}
+
+// GB/s of a[i] = b[i] + s * c[i] over mib MiB arrays on tn threads, best of five
+double measure_bw(size_t mib, int tn)
+{
+    size_t n = (mib << 20) / sizeof(double);
+    double *a = (double *)_mm_malloc(n * sizeof(double), 64);
+    double *b = (double *)_mm_malloc(n * sizeof(double), 64);
+    double *c = (double *)_mm_malloc(n * sizeof(double), 64);
+#pragma omp parallel for num_threads(tn) schedule(static)
+    for (size_t i = 0; i < n; i++)
+    {
+        a[i] = 0.0;
+        b[i] = 1.0;
+        c[i] = 2.0;
+    }
+    double best = 0.0;
+    for (int r = 0; r < 5; r++)
+    {
+        auto t0 = std::chrono::steady_clock::now();
+#pragma omp parallel for simd num_threads(tn) schedule(static)
+        for (size_t i = 0; i < n; i++)
+        {
+            a[i] = b[i] + 0.5 * c[i];
+        }
+        auto t1 = std::chrono::steady_clock::now();
+        best = max(best, 3.0 * n * sizeof(double) / seconds(t0, t1) * 1e-9);
+    }
+    _mm_free(a);
+    _mm_free(b);
+    _mm_free(c);
+    return best;
+}
+
+// per-thread perf_event counters, opened by every thread of a team for
+// itself and enabled, disabled and read from the calling thread
+struct Counters
+{
+    static constexpr int NE = 5;
+    static const char *names[NE];
+    vector<int> fds;
+    bool ok = false;
+
+    void open(int tn)
+    {
+        close();
+        fds.assign((size_t)tn * NE, -1);
+        uint64_t configs[NE][2] = {
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+            {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                                     PERF_COUNT_HW_CACHE_RESULT_MISS << 16},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+            // FP_ARITH_INST_RETIRED, all umasks: vector and scalar fp
+            // instructions on Intel (not weighted by lanes)
+            {PERF_TYPE_RAW, 0xffc7},
+        };
+        bool intel = __builtin_cpu_is("intel");
+#pragma omp parallel num_threads(tn)
+        {
+            int ti = omp_get_thread_num();
+            for (int e = 0; e < NE; e++)
+            {
+                if (e == 4 && !intel)
+                    continue;
+                perf_event_attr pe;
+                memset(&pe, 0, sizeof(pe));
+                pe.size = sizeof(pe);
+                pe.type = configs[e][0];
+                pe.config = configs[e][1];
+                pe.disabled = 1;
+                pe.exclude_kernel = 1;
+                pe.exclude_hv = 1;
+                fds[(size_t)ti * NE + e] = syscall(SYS_perf_event_open, &pe, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+            }
+        }
+        ok = fds[0] >= 0;
+    }
+
+    void ctl(unsigned long req)
+    {
+        for (int fd : fds)
+        {
+            if (fd >= 0)
+                ioctl(fd, req, 0);
+        }
+    }
+
+    // sums over the threads, -1 for events that could not be opened
+    void read(double *v)
+    {
+        for (int e = 0; e < NE; e++)
+        {
+            v[e] = -1.0;
+            for (size_t t = 0; t < fds.size() / NE; t++)
+            {
+                uint64_t x;
+                int fd = fds[t * NE + e];
+                if (fd >= 0 && ::read(fd, &x, sizeof(x)) == sizeof(x))
+                    v[e] = max(v[e], 0.0) + x;
+            }
+        }
+    }
+
+    void close()
+    {
+        for (int fd : fds)
+        {
+            if (fd >= 0)
+                ::close(fd);
+        }
+        fds.clear();
+    }
+
+    ~Counters()
+    {
+        close();
+    }
+};
+
+const char *Counters::names[NE] = {"cycles", "instructions", "l1d_miss", "llc_miss", "fp_instr"};
+
+vector<string> split(const char *s)
+{
+    vector<string> v;
+    string cur;
+    for (; ; s++)
+    {
+        if (*s == ',' || *s == 0)
+        {
+            if (!cur.empty())
+                v.push_back(cur);
+            cur.clear();
+            if (*s == 0)
+                break;
+        }
+        else
+            cur += *s;
+    }
+    return v;
+}
+
+// baseline medians keyed by "shape,threads,path"
+map<string, double> read_baseline(const char *path)
+{
+    map<string, double> base;
+    FILE *f = fopen(path, "r");
+    if (!f)
+    {
+        fprintf(stderr, "bench: cannot open %s\n", path);
+        exit(2);
+    }
+    char line[1024];
+    while (fgets(line, sizeof(line), f))
+    {
+        vector<string> cols = split(line);
+        if (cols.size() < 5 || cols[0] == "shape")
+            continue;
+        base[cols[0] + "," + cols[1] + "," + cols[2]] = atof(cols[4].c_str());
+    }
+    fclose(f);
+    return base;
+}
+
+int main(int argc, char *argv[])
+{
+    vector<Shape> shapes = {{512, 512, 512}, {1024, 1024, 1024}, {2048, 2048, 2048}, {4096, 256, 4096},
+                            {16, 8192, 512}};
+    vector<int> threads = {1};
+    if (omp_get_max_threads() > 1)
+        threads.push_back(omp_get_max_threads());
+    vector<string> want;
+    int reps = 5;
+    size_t mib = 256;
+    bool counters = false;
+    const char *baseline = nullptr;
+    double tol = 0.1;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-c") == 0)
+            counters = true;
+        else if (i + 1 >= argc)
+            break;
+        else if (strcmp(argv[i], "-s") == 0)
+        {
+            shapes.clear();
+            for (string &s : split(argv[++i]))
+            {
+                Shape sh;
+                int got = sscanf(s.c_str(), "%lux%lux%lu", &sh.n1, &sh.n2, &sh.n3);
+                if (got == 1)
+                    sh.n2 = sh.n3 = sh.n1;
+                if (got == 1 || got == 3)
+                    shapes.push_back(sh);
+            }
+        }
+        else if (strcmp(argv[i], "-t") == 0)
+        {
+            threads.clear();
+            for (string &s : split(argv[++i]))
+                threads.push_back(max(1, atoi(s.c_str())));
+        }
+        else if (strcmp(argv[i], "-k") == 0)
+            want = split(argv[++i]);
+        else if (strcmp(argv[i], "-r") == 0)
+            reps = max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "-m") == 0)
+            mib = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-g") == 0)
+            baseline = argv[++i];
+        else if (strcmp(argv[i], "-d") == 0)
+            tol = atof(argv[++i]);
+    }
+    map<string, double> base;
+    if (baseline)
+        base = read_baseline(baseline);
+
+    uint64_t maxa = 0, maxb = 0, maxc = 0;
+    for (Shape &s : shapes)
+    {
+        maxa = max(maxa, s.n1 * s.n2);
+        maxb = max(maxb, s.n2 * s.n3);
+        maxc = max(maxc, s.n1 * s.n3);
+    }
+    double *a = (double *)_mm_malloc(maxa * sizeof(double), 64);
+    double *b = (double *)_mm_malloc(maxb * sizeof(double), 64);
+    double *c = (double *)_mm_malloc(maxc * sizeof(double), 64);
+#pragma omp parallel for schedule(static)
+    for (uint64_t i = 0; i < max(maxa, maxb); i++)
+    {
+        uint64_t h = (i + 1) * 0x9e3779b97f4a7c15ull;
+        h ^= h >> 29;
+        if (i < maxa)
+            a[i] = (double)(h >> 11) * 0x1p-52 - 1.0;
+        if (i < maxb)
+            b[i] = (double)((h * 0xbf58476d1ce4e5b9ull) >> 11) * 0x1p-52 - 1.0;
+    }
+
+    Counters ctr;
+    bool regress = false;
+    printf("shape,threads,path,median_ms,gflops,min_gflops,max_gflops,cv_pct,peak,peak_pct,bw_gbs,roof,roof_pct");
+    if (counters)
+    {
+        for (const char *n : Counters::names)
+            printf(",%s", n);
+    }
+    printf("\n");
+
+    for (int tn : threads)
+    {
+        omp_set_num_threads(tn);
+        double bw = measure_bw(mib, tn);
+        if (counters)
+        {
+            ctr.open(tn);
+            if (!ctr.ok)
+                fprintf(stderr, "bench: perf_event_open failed (%s), counters are -1\n", strerror(errno));
+        }
+        for (const Path &p : paths)
+        {
+            if (!p.ok || (!want.empty() && find(want.begin(), want.end(), p.name) == want.end()))
+                continue;
+            double peak = measure_peak(p.probe, tn);
+            for (Shape &s : shapes)
+            {
+                double flops = 2.0 * s.n1 * s.n2 * s.n3;
+                double ai = flops / (8.0 * (s.n1 * s.n2 + s.n2 * s.n3 + 2 * s.n1 * s.n3));
+                double roof = min(peak, ai * bw);
+                vector<double> ms;
+                double ev[Counters::NE], sum[Counters::NE] = {0.0};
+                for (int r = 0; r <= reps; r++)
+                {
+                    fill(c, c + s.n1 * s.n3, 0.0);
+                    if (r > 0 && counters)
+                    {
+                        ctr.ctl(PERF_EVENT_IOC_RESET);
+                        ctr.ctl(PERF_EVENT_IOC_ENABLE);
+                    }
+                    auto t0 = std::chrono::steady_clock::now();
+                    p.run(a, b, c, s.n1, s.n2, s.n3);
+                    auto t1 = std::chrono::steady_clock::now();
+                    if (r == 0)
+                        continue;
+                    if (counters)
+                    {
+                        ctr.ctl(PERF_EVENT_IOC_DISABLE);
+                        ctr.read(ev);
+                        for (int e = 0; e < Counters::NE; e++)
+                            sum[e] = ev[e] < 0 ? -1.0 : sum[e] + ev[e] / reps;
+                    }
+                    ms.push_back(seconds(t0, t1) * 1e3);
+                }
+                std::sort(ms.begin(), ms.end());
+                double med = ms[ms.size() / 2];
+                double mean = 0.0, var = 0.0;
+                for (double x : ms)
+                    mean += x / ms.size();
+                for (double x : ms)
+                    var += (x - mean) * (x - mean) / ms.size();
+                double gf = flops / med * 1e-6;
+                char key[256];
+                snprintf(key, sizeof(key), "%lux%lux%lu,%d,%s", s.n1, s.n2, s.n3, tn, p.name);
+                printf("%s,%.3f,%.2f,%.2f,%.2f,%.2f,%.2f,%.1f,%.2f,%.2f,%.1f", key, med, gf,
+                       flops / ms.back() * 1e-6, flops / ms.front() * 1e-6, 100.0 * sqrt(var) / mean, peak,
+                       100.0 * gf / peak, bw, roof, 100.0 * gf / roof);
+                if (counters)
+                {
+                    for (double e : sum)
+                        printf(",%.0f", e);
+                }
+                printf("\n");
+                fflush(stdout);
+                auto it = base.find(key);
+                if (it != base.end() && gf < (1.0 - tol) * it->second)
+                {
+                    fprintf(stderr, "bench: %s regressed, %.2f GFLOP/s against %.2f\n", key, gf, it->second);
+                    regress = true;
+                }
+            }
+        }
+    }
+
+    _mm_free(a);
+    _mm_free(b);
+    _mm_free(c);
+    return regress;
+}
@@ -0,0 +1,98 @@
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <omp.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// compares two out.data files (n1 * n3 doubles, no header), e.g. the fp64
+// result against an -f fp32 or -f bf16 one:
+//   max rel: max |x - r| / |r| over the elements with r != 0
+//   max abs: max |x - r|
+//   norm:    ||x - r||_F / ||r||_F, the bound mixed precision is judged by
+// exits with 1 when norm exceeds tol (default 1e-2)
+
+struct Mapped
+{
+    size_t bytes = 0;
+    const double *p = nullptr;
+
+    bool open(const char *path)
+    {
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0)
+        {
+            close(fd);
+            return false;
+        }
+        bytes = st.st_size;
+        void *m = mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (m == MAP_FAILED)
+            return false;
+        madvise(m, bytes, MADV_SEQUENTIAL);
+        p = (const double *)m;
+        return true;
+    }
+
+    ~Mapped()
+    {
+        if (p)
+            munmap((void *)p, bytes);
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        printf("Usage: %s <ref> <test> [tol]\n", argv[0]);
+        return -1;
+    }
+    double tol = argc > 3 ? atof(argv[3]) : 1e-2;
+
+    Mapped ref, test;
+    if (!ref.open(argv[1]))
+    {
+        printf("Error opening file: %s\n", argv[1]);
+        return -1;
+    }
+    if (!test.open(argv[2]))
+    {
+        printf("Error opening file: %s\n", argv[2]);
+        return -1;
+    }
+    if (ref.bytes != test.bytes)
+    {
+        printf("Size mismatch: %zu %zu\n", ref.bytes, test.bytes);
+        return -1;
+    }
+    int64_t n = ref.bytes / sizeof(double);
+
+    double rel = 0.0, abs_ = 0.0, d2 = 0.0, r2 = 0.0;
+    int64_t bad = 0;
+#pragma omp parallel for simd reduction(max : rel, abs_) reduction(+ : d2, r2, bad) schedule(static)
+    for (int64_t i = 0; i < n; i++)
+    {
+        double r = ref.p[i];
+        double d = fabs(test.p[i] - r);
+        bad += d != d;
+        abs_ = fmax(abs_, d);
+        rel = r != 0.0 ? fmax(rel, d / fabs(r)) : rel;
+        d2 += d * d;
+        r2 += r * r;
+    }
+    double norm = r2 > 0.0 ? sqrt(d2 / r2) : sqrt(d2);
+
+    printf("max rel: %e\nmax abs: %e\nnorm: %e\n", rel, abs_, norm);
+    if (bad)
+        printf("nan: %lld\n", (long long)bad);
+    return bad || !(norm <= tol);
+}
@@ -1,5 +1,19 @@
 #include <iostream>
 #include <chrono>
+#include <immintrin.h>
+#include <string.h>
+#include <numeric>
+#include <algorithm>
+#include <future>
+#include <vector>
+#include <omp.h>
+
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+
+// every kernel keeps the (r * x) * (1 - x) order of the reference program,
+// lanes are independent so several vector chains hide the mul latency
 
 template <int n>
 void it(double r, double *x, int64_t itn)
@@ -13,44 +27,423 @@ void it(double r, double *x, int64_t itn)
     }
 }
 
-template <int gn>
-void itvg(double r, double *x, int64_t n, int64_t itn)
+template <int nv>
+__attribute__((target("avx512f"))) void it_avx512(double r, double *x, int64_t itn)
 {
+    __m512d rv = _mm512_set1_pd(r);
+    __m512d one = _mm512_set1_pd(1.0);
+    __m512d xv[nv];
+    for (int j = 0; j < nv; j++)
+    {
+        xv[j] = _mm512_loadu_pd(x + j * 8);
+    }
+    for (int64_t i = 0; i < itn; i++)
+    {
+        for (int j = 0; j < nv; j++)
+        {
+            xv[j] = _mm512_mul_pd(_mm512_mul_pd(rv, xv[j]), _mm512_sub_pd(one, xv[j]));
+        }
+    }
+    for (int j = 0; j < nv; j++)
+    {
+        _mm512_storeu_pd(x + j * 8, xv[j]);
+    }
+}
 
-#pragma omp parallel for
-    for (int64_t i = 0; i < n; i += gn)
+template <int nv>
+__attribute__((target("avx2"))) void it_avx2(double r, double *x, int64_t itn)
+{
+    __m256d rv = _mm256_set1_pd(r);
+    __m256d one = _mm256_set1_pd(1.0);
+    __m256d xv[nv];
+    for (int j = 0; j < nv; j++)
     {
-        it<gn>(r, x + i, itn);
+        xv[j] = _mm256_loadu_pd(x + j * 4);
+    }
+    for (int64_t i = 0; i < itn; i++)
+    {
+        for (int j = 0; j < nv; j++)
+        {
+            xv[j] = _mm256_mul_pd(_mm256_mul_pd(rv, xv[j]), _mm256_sub_pd(one, xv[j]));
+        }
+    }
+    for (int j = 0; j < nv; j++)
+    {
+        _mm256_storeu_pd(x + j * 4, xv[j]);
     }
 }
 
-int main()
+template <int nv>
+void it_sse2(double r, double *x, int64_t itn)
 {
+    __m128d rv = _mm_set1_pd(r);
+    __m128d one = _mm_set1_pd(1.0);
+    __m128d xv[nv];
+    for (int j = 0; j < nv; j++)
+    {
+        xv[j] = _mm_loadu_pd(x + j * 2);
+    }
+    for (int64_t i = 0; i < itn; i++)
+    {
+        for (int j = 0; j < nv; j++)
+        {
+            xv[j] = _mm_mul_pd(_mm_mul_pd(rv, xv[j]), _mm_sub_pd(one, xv[j]));
+        }
+    }
+    for (int j = 0; j < nv; j++)
+    {
+        _mm_storeu_pd(x + j * 2, xv[j]);
+    }
+}
 
-    FILE *fi;
-    fi = fopen("conf.data", "rb");
+struct itker
+{
+    const char *name;
+    int gn;
+    void (*f)(double r, double *x, int64_t itn);
+};
 
-    int64_t itn;
-    double r;
-    int64_t n;
-    double *x;
+// 16 zmm chains use half the register file, avx2 and sse2 only have 16 registers
+const itker itkers[] = {
+    {"avx512", 128, it_avx512<16>},
+    {"avx2", 48, it_avx2<12>},
+    {"sse2", 24, it_sse2<12>},
+    {"scalar", 8, it<8>},
+};
+
+const itker &select_itker()
+{
+    const char *s = getenv("LOGISTIC_ISA");
+    if (s != nullptr)
+    {
+        for (const itker &k : itkers)
+        {
+            if (strcmp(s, k.name) == 0)
+                return k;
+        }
+    }
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return itkers[0];
+    if (__builtin_cpu_supports("avx2"))
+        return itkers[1];
+    if (__builtin_cpu_supports("sse2"))
+        return itkers[2];
+    return itkers[3];
+}
+
+// early exit for converged groups, 0 disables it: every cycle_interval
+// iterations the group is stepped up to cycle_maxp more times, and once it
+// returns bit-exactly to the saved state with period p the remaining
+// iterations reduce to (rest % p), which is bit-identical to brute force
+int64_t cycle_interval = 0;
+constexpr int64_t cycle_maxp = 64;
+
+void itcycle(const itker &k, double r, double *x, int64_t itn)
+{
+    alignas(64) double s[128];
+    int64_t done = 0;
+    while (done < itn)
+    {
+        int64_t step = std::min(cycle_interval, itn - done);
+        k.f(r, x, step);
+        done += step;
+
+        memcpy(s, x, k.gn * 8);
+        for (int64_t p = 1; p <= cycle_maxp && done < itn; p++)
+        {
+            k.f(r, x, 1);
+            done++;
+            if (memcmp(s, x, k.gn * 8) == 0)
+            {
+                k.f(r, x, (itn - done) % p);
+                return;
+            }
+        }
+    }
+}
 
+void itrange(const itker &k, double r, double *x, int64_t is, int64_t ie, int64_t itn)
+{
+    int64_t i = is;
+    for (; i + k.gn <= ie; i += k.gn)
+    {
+        if (cycle_interval > 0)
+            itcycle(k, r, x + i, itn);
+        else
+            k.f(r, x + i, itn);
+    }
+    for (; i < ie; i++)
+    {
+        it<1>(r, x + i, itn);
+    }
+}
+
+// pin thread ti to the ti-th cpu of the process mask unless OMP_PROC_BIND already does it
+void pin_thread(const cpu_set_t &mask, int ti)
+{
+    int cnt = CPU_COUNT(&mask);
+    if (cnt == 0)
+        return;
+    int target = ti % cnt;
+    for (int c = 0; c < CPU_SETSIZE; c++)
+    {
+        if (CPU_ISSET(c, &mask) && target-- == 0)
+        {
+            cpu_set_t one;
+            CPU_ZERO(&one);
+            CPU_SET(c, &one);
+            sched_setaffinity(0, sizeof(one), &one);
+            return;
+        }
+    }
+}
+
+// wall times in seconds of the phases of a run; for itvg the slowest thread
+// of every phase, for itstream the iteration alone, the I/O overlaps it
+struct ittimes
+{
+    double read = 0, compute = 0, write = 0;
+};
+
+double since(std::chrono::steady_clock::time_point t)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+}
+
+// every thread reads, iterates and writes its own page-aligned range, so the
+// pages are first touched on the node of the thread that computes them
+void itvg(const itker &k, double r, double *x, int64_t n, int64_t itn, int fdi, int fdo, off_t off, ittimes &tm)
+{
+    int64_t unit = std::lcm<int64_t>(k.gn, 4096 / 8);
+    int64_t nu = (n + unit - 1) / unit;
+    bool pin = omp_get_proc_bind() == omp_proc_bind_false;
+    cpu_set_t mask;
+    sched_getaffinity(0, sizeof(mask), &mask);
+
+    double tr = 0, tc = 0, tw = 0;
+#pragma omp parallel reduction(max : tr, tc, tw)
+    {
+        int ti = omp_get_thread_num();
+        int tn = omp_get_num_threads();
+        if (pin)
+            pin_thread(mask, ti);
+        int64_t is = std::min(n, nu * ti / tn * unit);
+        int64_t ie = std::min(n, nu * (ti + 1) / tn * unit);
+
+        auto t = std::chrono::steady_clock::now();
+        for (int64_t i = is * 8; i < ie * 8;)
+        {
+            ssize_t len = pread(fdi, (char *)x + i, ie * 8 - i, off + i);
+            if (len <= 0)
+                break;
+            i += len;
+        }
+        tr = since(t);
+        t = std::chrono::steady_clock::now();
+        itrange(k, r, x, is, ie, itn);
+        tc = since(t);
+        t = std::chrono::steady_clock::now();
+        for (int64_t i = is * 8; i < ie * 8;)
+        {
+            ssize_t len = pwrite(fdo, (char *)x + i, ie * 8 - i, i);
+            if (len <= 0)
+                break;
+            i += len;
+        }
+        tw = since(t);
+    }
+    tm.read = tr;
+    tm.compute = tc;
+    tm.write = tw;
+}
+
+// streaming mode for inputs larger than memory: chunk c + 1 is read and
+// chunk c - 1 written in the background while chunk c is iterated
+void itstream(const itker &k, double r, int64_t n, int64_t itn, int fdi, int fdo, off_t off, int64_t chunk,
+              ittimes &tm)
+{
+    int64_t unit = std::lcm<int64_t>(k.gn, 4096 / 8);
+    chunk = std::max(unit, chunk / unit * unit);
+    int64_t nc = (n + chunk - 1) / chunk;
+    double *buf[3];
+    for (int i = 0; i < 3; i++)
+    {
+        buf[i] = (double *)aligned_alloc(4096, chunk * 8);
+    }
+
+    auto len = [&](int64_t c)
+    { return std::min(chunk, n - c * chunk) * 8; };
+    auto rd = [&](int64_t c)
+    {
+        for (int64_t i = 0; i < len(c);)
+        {
+            ssize_t l = pread(fdi, (char *)buf[c % 3] + i, len(c) - i, off + c * chunk * 8 + i);
+            if (l <= 0)
+                break;
+            i += l;
+        }
+    };
+    auto wr = [&](int64_t c)
+    {
+        for (int64_t i = 0; i < len(c);)
+        {
+            ssize_t l = pwrite(fdo, (char *)buf[c % 3] + i, len(c) - i, c * chunk * 8 + i);
+            if (l <= 0)
+                break;
+            i += l;
+        }
+    };
+
+    std::future<void> fr = std::async(std::launch::async, rd, 0);
+    std::future<void> fw;
+    for (int64_t c = 0; c < nc; c++)
+    {
+        fr.get();
+        if (c + 1 < nc)
+            fr = std::async(std::launch::async, rd, c + 1);
+
+        double *x = buf[c % 3];
+        int64_t m = len(c) / 8;
+        int64_t ng = (m + k.gn - 1) / k.gn;
+        auto t = std::chrono::steady_clock::now();
+#pragma omp parallel for
+        for (int64_t i = 0; i < ng; i++)
+        {
+            itrange(k, r, x, i * k.gn, std::min(m, (i + 1) * k.gn), itn);
+        }
+        tm.compute += since(t);
+
+        if (fw.valid())
+            fw.get();
+        fw = std::async(std::launch::async, wr, c);
+    }
+    if (fw.valid())
+        fw.get();
+
+    for (int i = 0; i < 3; i++)
+    {
+        free(buf[i]);
+    }
+}
+
+// sweep mode for bifurcation diagrams, sweep.data holds
+//   itn, nr, m, nbin (64 bit integers), r[nr], x0[m] (64 bit floats)
+// every r iterates its own copy of x0 and the final states are binned over
+// [0, 1) while the group is still in cache, out.data receives nr * nbin
+// 64 bit counts; states below 0 count in the first bin and states at or
+// above 1 in the last, so an r outside [0, 4], which diverges to -inf and
+// then NaN, piles up in the first bin, NaN included
+void itsweep(const itker &k, const char *path)
+{
+    FILE *fi = fopen(path, "rb");
+    int64_t itn, nr, m, nbin;
     fread(&itn, 1, 8, fi);
-    fread(&r, 1, 8, fi);
-    fread(&n, 1, 8, fi);
-    x = (double *)malloc(n * 8);
-    fread(x, 1, n * 8, fi);
+    fread(&nr, 1, 8, fi);
+    fread(&m, 1, 8, fi);
+    fread(&nbin, 1, 8, fi);
+    std::vector<double> r(nr), x0(m);
+    fread(r.data(), 1, nr * 8, fi);
+    fread(x0.data(), 1, m * 8, fi);
     fclose(fi);
 
+    std::vector<int64_t> hist(nr * nbin, 0);
+
     auto t1 = std::chrono::steady_clock::now();
-    itvg<128>(r, x, n, itn);
+#pragma omp parallel for schedule(dynamic)
+    for (int64_t ri = 0; ri < nr; ri++)
+    {
+        alignas(64) double g[128];
+        int64_t *h = hist.data() + ri * nbin;
+        for (int64_t i = 0; i < m; i += k.gn)
+        {
+            int64_t len = std::min<int64_t>(k.gn, m - i);
+            memcpy(g, x0.data() + i, len * 8);
+            itrange(k, r[ri], g, 0, len, itn);
+            for (int64_t j = 0; j < len; j++)
+            {
+                // clamped as a double, the conversion of NaN or inf is undefined
+                double t = g[j] * nbin;
+                int64_t b = t >= 0 && t < nbin ? (int64_t)t : (t >= nbin ? nbin - 1 : 0);
+                h[b]++;
+            }
+        }
+    }
     auto t2 = std::chrono::steady_clock::now();
     int d1 = std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1).count();
     printf("%d\n", d1);
 
-    fi = fopen("out.data", "wb");
-    fwrite(x, 1, n * 8, fi);
-    fclose(fi);
+    FILE *fo = fopen("out.data", "wb");
+    fwrite(hist.data(), 1, nr * nbin * 8, fo);
+    fclose(fo);
+}
+
+int main(int argc, char *argv[])
+{
+    // -s <MiB>: stream in chunks of the given size instead of holding all of x,
+    // also chosen automatically when x does not fit in half of physical memory
+    // -r <sweep.data>: batched multi-r sweep, see itsweep
+    // -c <interval>: check groups for cycles every interval iterations, see itcycle
+    int64_t chunk = 0;
+    const char *sweep = nullptr;
+    for (int i = 1; i + 1 < argc; i++)
+    {
+        if (strcmp(argv[i], "-s") == 0)
+            chunk = atoll(argv[++i]) << 17;
+        else if (strcmp(argv[i], "-r") == 0)
+            sweep = argv[++i];
+        else if (strcmp(argv[i], "-c") == 0)
+            cycle_interval = atoll(argv[++i]);
+    }
+
+    const itker &k = select_itker();
+    fprintf(stderr, "isa: %s\n", k.name);
+
+    if (sweep != nullptr)
+    {
+        itsweep(k, sweep);
+        return 0;
+    }
+
+    int fdi = open("conf.data", O_RDONLY);
+
+    int64_t itn;
+    double r;
+    int64_t n;
+    double *x;
+
+    pread(fdi, &itn, 8, 0);
+    pread(fdi, &r, 8, 8);
+    pread(fdi, &n, 8, 16);
+
+    int64_t mem = sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+    if (chunk == 0 && n * 8 > mem / 2)
+        chunk = int64_t(256) << 17;
+
+    int fdo = open("out.data", O_WRONLY | O_CREAT | O_TRUNC, 00644);
+    ftruncate(fdo, n * 8);
+
+    // stdout keeps the iteration time alone, as the baseline printed it; the
+    // reads and writes now happen inside the same call and go to stderr
+    ittimes tm;
+    auto t1 = std::chrono::steady_clock::now();
+    if (chunk > 0)
+    {
+        itstream(k, r, n, itn, fdi, fdo, 24, chunk, tm);
+    }
+    else
+    {
+        x = (double *)aligned_alloc(4096, (n * 8 + 4095) / 4096 * 4096);
+        itvg(k, r, x, n, itn, fdi, fdo, 24, tm);
+        free(x);
+    }
+    double total = since(t1);
+    printf("%d\n", int(tm.compute * 1000));
+    fprintf(stderr, "read %d ms, iterate %d ms, write %d ms, total %d ms\n", int(tm.read * 1000),
+            int(tm.compute * 1000), int(tm.write * 1000), int(total * 1000));
+
+    close(fdi);
+    close(fdo);
 
     return 0;
 }
@@ -1,72 +1,205 @@
 #include <array>
-#include <fstream>
-#include <iostream>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
 #include <omp.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <vector>
 
 using namespace std;
 
+const char *gridname[4] = {"velocityu", "velocityv", "weightu", "weightv"};
+
+// a result file mapped read-only: int resolution, then the four
+// (resolution + 1) * resolution double grids {u, v, wu, wv}
+struct Result
+{
+    int resolution = 0;
+    size_t bytes = 0;
+    const char *base = nullptr;
+    const double *grid[4] = {nullptr};
+
+    bool open(const char *path)
+    {
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(int))
+        {
+            close(fd);
+            return false;
+        }
+        bytes = st.st_size;
+        void *p = mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED)
+            return false;
+        madvise(p, bytes, MADV_SEQUENTIAL);
+        base = (const char *)p;
+        memcpy(&resolution, base, sizeof(int));
+        size_t n = (size_t)(resolution + 1) * resolution;
+        if (resolution <= 0 || bytes < sizeof(int) + 4 * n * sizeof(double))
+            return false;
+        for (int g = 0; g < 4; g++)
+            grid[g] = (const double *)(base + sizeof(int)) + g * n;
+        return true;
+    }
+
+    ~Result()
+    {
+        if (base)
+            munmap((void *)base, bytes);
+    }
+};
+
 int main(int argc, char *argv[])
 {
-    if (argc != 3)
+    if (argc < 3)
     {
-        printf("Usage: %s <seq> <para>\n", argv[0]);
+        printf("Usage: %s <seq> <para> [-m] [-t tile heatmap]\n", argv[0]);
         return -1;
     }
 
-    string fileseq(argv[1]);
-    string filepara(argv[2]);
-    ifstream finseq(fileseq, ios::binary);
-    ifstream finpara(filepara, ios::binary);
-    if (!finseq)
+    // -m: print the largest error of every grid and where it is
+    // -t: write the mean abs error of every tile x tile block, averaged over
+    //     the four grids, as a text matrix with one line per block row
+    bool maxloc = false;
+    int tile = 0;
+    string heatmap;
+    for (int i = 3; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-m") == 0)
+            maxloc = true;
+        else if (strcmp(argv[i], "-t") == 0 && i + 2 < argc)
+        {
+            tile = atoi(argv[++i]);
+            heatmap = argv[++i];
+        }
+    }
+
+    Result seq, para;
+    if (!seq.open(argv[1]))
     {
         printf("Error opening file: %s", argv[1]);
         return -1;
     }
-    if (!finpara)
+    if (!para.open(argv[2]))
     {
         printf("Error opening file: %s", argv[2]);
         return -1;
     }
-    int resolution;
-    finseq.read((char *)(&resolution), sizeof(int));
-    finpara.read((char *)(&resolution), sizeof(int));
-    vector<double> velocityu((resolution + 1) * resolution);
-    vector<double> velocityv((resolution + 1) * resolution);
-    vector<double> weightu((resolution + 1) * resolution);
-    vector<double> weightv((resolution + 1) * resolution);
+    if (seq.resolution != para.resolution)
+    {
+        printf("Resolution mismatch: %d %d", seq.resolution, para.resolution);
+        return -1;
+    }
+    int resolution = seq.resolution;
+    int64_t n = (int64_t)resolution * (resolution + 1);
 
-    vector<double> velocityu_parallel((resolution + 1) * resolution);
-    vector<double> velocityv_parallel((resolution + 1) * resolution);
-    vector<double> weightu_parallel((resolution + 1) * resolution);
-    vector<double> weightv_parallel((resolution + 1) * resolution);
+    double r1[4] = {0.0};
+    for (int g = 0; g < 4; g++)
+    {
+        const double *a = seq.grid[g];
+        const double *b = para.grid[g];
+        double s = 0.0;
+#pragma omp parallel for simd reduction(+ : s) schedule(static)
+        for (int64_t i = 0; i < n; i++)
+        {
+            s += fabs(a[i] - b[i]);
+        }
+        r1[g] = s / n;
+    }
 
-    finseq.read((char *)(velocityu.data()), sizeof(double) * velocityu.size());
-    finseq.read((char *)(velocityv.data()), sizeof(double) * velocityv.size());
-    finseq.read((char *)(weightu.data()), sizeof(double) * weightu.size());
-    finseq.read((char *)(weightv.data()), sizeof(double) * weightv.size());
+    // u is (resolution + 1) x resolution, v is resolution x (resolution + 1)
+    int gw[4] = {resolution, resolution + 1, resolution, resolution + 1};
+    int gh[4] = {resolution + 1, resolution, resolution + 1, resolution};
 
-    finpara.read((char *)(velocityu_parallel.data()),
-                 sizeof(double) * velocityu_parallel.size());
-    finpara.read((char *)(velocityv_parallel.data()),
-                 sizeof(double) * velocityv_parallel.size());
-    finpara.read((char *)(weightu_parallel.data()),
-                 sizeof(double) * weightu_parallel.size());
-    finpara.read((char *)(weightv_parallel.data()),
-                 sizeof(double) * weightv_parallel.size());
+    if (maxloc)
+    {
+        for (int g = 0; g < 4; g++)
+        {
+            const double *a = seq.grid[g];
+            const double *b = para.grid[g];
+            double emax = -1.0;
+            int64_t imax = 0;
+#pragma omp parallel
+            {
+                double e = -1.0;
+                int64_t k = 0;
+#pragma omp for schedule(static) nowait
+                for (int64_t i = 0; i < n; i++)
+                {
+                    double d = fabs(a[i] - b[i]);
+                    if (d > e || d != d)
+                    {
+                        e = d;
+                        k = i;
+                    }
+                }
+#pragma omp critical
+                if (e > emax || e != e || (e == emax && k < imax))
+                {
+                    emax = e;
+                    imax = k;
+                }
+            }
+            printf("max %s: %e at (%lld, %lld) seq %e para %e\n", gridname[g], emax, (long long)(imax / gw[g]),
+                   (long long)(imax % gw[g]), a[imax], b[imax]);
+        }
+    }
 
-    double r1[4] = {0.0};
-    for (int i = 0; i < resolution * (resolution + 1); i++)
+    if (tile > 0)
     {
-        r1[0] += abs(velocityu[i] - velocityu_parallel[i]);
-        r1[1] += abs(velocityv[i] - velocityv_parallel[i]);
-        r1[2] += abs(weightu[i] - weightu_parallel[i]);
-        r1[3] += abs(weightv[i] - weightv_parallel[i]);
+        int tx = (resolution + 1 + tile - 1) / tile;
+        int ty = tx;
+        vector<double> err((size_t)tx * ty, 0.0);
+        vector<double> cnt((size_t)tx * ty, 0.0);
+#pragma omp parallel for schedule(dynamic)
+        for (int bx = 0; bx < tx; bx++)
+        {
+            for (int g = 0; g < 4; g++)
+            {
+                const double *a = seq.grid[g];
+                const double *b = para.grid[g];
+                for (int x = bx * tile; x < min((bx + 1) * tile, gh[g]); x++)
+                {
+                    for (int by = 0; by * tile < gw[g]; by++)
+                    {
+                        int ye = min((by + 1) * tile, gw[g]);
+                        double s = 0.0;
+#pragma omp simd reduction(+ : s)
+                        for (int y = by * tile; y < ye; y++)
+                        {
+                            s += fabs(a[(int64_t)x * gw[g] + y] - b[(int64_t)x * gw[g] + y]);
+                        }
+                        err[(size_t)bx * ty + by] += s;
+                        cnt[(size_t)bx * ty + by] += ye - by * tile;
+                    }
+                }
+            }
+        }
+        FILE *f = fopen(heatmap.c_str(), "w");
+        if (!f)
+        {
+            printf("Error output file: %s", heatmap.c_str());
+            return -1;
+        }
+        for (int bx = 0; bx < tx; bx++)
+        {
+            for (int by = 0; by < ty; by++)
+            {
+                size_t t = (size_t)bx * ty + by;
+                fprintf(f, by + 1 < ty ? "%.3e " : "%.3e\n", cnt[t] > 0 ? err[t] / cnt[t] : 0.0);
+            }
+        }
+        fclose(f);
     }
-    r1[0] /= resolution * (resolution + 1);
-    r1[1] /= resolution * (resolution + 1);
-    r1[2] /= resolution * (resolution + 1);
-    r1[3] /= resolution * (resolution + 1);
 
     int retval = 0;
 